@@ -18,31 +18,76 @@
 
 #include "aesd-circular-buffer.h"
 
+/**
+ * @return the offset of byte @param char_offset of the entry @param cmd_offset entries after the oldest,
+ *      or -EINVAL if there is no such entry or byte
+ */
 long aesd_circular_buffer_offset_adjust(struct aesd_circular_buffer *buffer,
             size_t cmd_offset, size_t char_offset)
 {
-    int i = 0;
-    int real_offset = 0;
+    size_t i;
+    long real_offset = 0;
     struct aesd_buffer_entry* entry;
-    while (i != cmd_offset) {
-        entry = buffer->entry[i];
-        if (entry == 0){
-            return -EINVAL;
-        }
-        real_offset += entry->size;
-        i = (i + 1) % 10;
-    };
-    entry = buffer->entry[i];
-    if (entry == 0){
+    if (cmd_offset >= aesd_circular_buffer_count(buffer)){
         return -EINVAL;
     }
-    if (entry->size < char_offset){
+    for (i = 0; i < cmd_offset; i++) {
+        entry = buffer->entry[(buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+        real_offset += entry->size;
+    }
+    entry = buffer->entry[(buffer->out_offs + cmd_offset) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    if (char_offset >= entry->size){
         return -EINVAL;
     }
     real_offset += char_offset;
     return real_offset;
 }
 
+/**
+ * @return the seq of the oldest entry, entries_added when @param buffer is empty
+ */
+uint64_t aesd_circular_buffer_oldest_seq(const struct aesd_circular_buffer *buffer)
+{
+    if (aesd_circular_buffer_count(buffer) == 0){
+        return buffer->entries_added;
+    }
+    return buffer->entry[buffer->out_offs]->seq;
+}
+
+/**
+ * Seqs are not contiguous once records were dropped while restoring persisted ones,
+ * so entries are matched by their seq rather than counted from the oldest.
+ * @return the offset of the first byte of the entry with sequence number @param seq,
+ *      the total size if @param seq is the next one to be added,
+ *      -ERANGE if it was already evicted or dropped and -EINVAL if it was never added
+ */
+long aesd_circular_buffer_seq_offset(struct aesd_circular_buffer *buffer, uint64_t seq)
+{
+    unsigned int count = aesd_circular_buffer_count(buffer);
+    long real_offset = 0;
+    struct aesd_buffer_entry* entry;
+    unsigned int i;
+
+    if (seq > buffer->entries_added){
+        return -EINVAL;
+    }
+    if (seq < aesd_circular_buffer_oldest_seq(buffer)){
+        return -ERANGE;
+    }
+    for (i = 0; i < count; i++){
+        entry = buffer->entry[(buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+        if (entry->seq == seq){
+            return real_offset;
+        }
+        if (entry->seq > seq){
+            // inside a gap left by a dropped record
+            return -ERANGE;
+        }
+        real_offset += entry->size;
+    }
+    return real_offset;
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -88,6 +133,7 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 * new start location.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* The seq of @param add_entry is set to the next write index.
 */
 struct aesd_buffer_entry * aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
@@ -99,20 +145,81 @@ struct aesd_buffer_entry * aesd_circular_buffer_add_entry(struct aesd_circular_b
     struct aesd_buffer_entry* last_entry = buffer->entry[target_in_offs];
 
     buffer->entry[target_in_offs] = (struct aesd_buffer_entry *)add_entry;
+    buffer->entry[target_in_offs]->seq = buffer->entries_added;
     buffer->in_offs = next_in_offs;
     buffer->size += add_entry->size;
+    buffer->stored_bytes += aesd_buffer_entry_stored(add_entry);
+    buffer->entries_added++;
     if (buffer->full){
         buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
         buffer->size -= last_entry->size;
+        buffer->stored_bytes -= aesd_buffer_entry_stored(last_entry);
         return last_entry;
     }
 
-    if (next_in_offs < target_in_offs){
+    if (next_in_offs == buffer->out_offs){
         buffer->full = true;
     }
     return NULL;
 }
 
+/**
+* @return the number of entries currently held by @param buffer
+*/
+unsigned int aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full){
+        return AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    return (buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs)
+            % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+* Removes the oldest entry of a non empty @param buffer and returns it.
+*/
+static struct aesd_buffer_entry *aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry* oldest = buffer->entry[buffer->out_offs];
+
+    buffer->entry[buffer->out_offs] = NULL;
+    buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->full = false;
+    buffer->size -= oldest->size;
+    buffer->stored_bytes -= aesd_buffer_entry_stored(oldest);
+    return oldest;
+}
+
+/**
+* Adds entry @param add_entry to @param buffer, first evicting as many of the oldest entries as needed
+* to stay within buffer->max_entries and buffer->max_bytes of stored bytes once it is added. The new entry is always
+* stored, even when it alone is larger than max_bytes.
+* Evicted entries are returned in @param evicted, oldest first, so the caller can free them all at once
+* after dropping its lock.
+* Any necessary locking must be handled by the caller
+* @return the number of entries stored in @param evicted
+*/
+size_t aesd_circular_buffer_add_entry_evict(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *add_entry,
+            struct aesd_buffer_entry *evicted[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED])
+{
+    unsigned int max_entries = buffer->max_entries;
+    unsigned int count = aesd_circular_buffer_count(buffer);
+    size_t nevicted = 0;
+
+    if (max_entries == 0 || max_entries > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED){
+        max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    while (count > 0 && (count >= max_entries ||
+            (buffer->max_bytes &&
+            buffer->stored_bytes + aesd_buffer_entry_stored(add_entry) > buffer->max_bytes))){
+        evicted[nevicted++] = aesd_circular_buffer_remove_oldest(buffer);
+        count--;
+    }
+    aesd_circular_buffer_add_entry(buffer, add_entry);
+    return nevicted;
+}
+
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
 */
@@ -16,8 +16,9 @@
 #include <stdbool.h>
 #endif
 
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
-#define AESD_DEBUG
+#endif
 #ifndef PDEBUG
 #ifdef AESD_DEBUG
 #  ifdef __KERNEL__
@@ -43,6 +44,18 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Bytes held in buffptr when it is compressed, 0 when buffptr holds size plain bytes
+     */
+    size_t zsize;
+    /**
+     * Monotonic write index, assigned from entries_added when the entry is added
+     */
+    uint64_t seq;
+    /**
+     * Commit time in nanoseconds, set by the caller
+     */
+    uint64_t timestamp_ns;
 };
 
 struct aesd_circular_buffer
@@ -65,13 +78,46 @@ struct aesd_circular_buffer
      */
     bool full;
     int size;
+    /**
+     * Memory held by the entries, counting compressed entries by their zsize
+     */
+    size_t stored_bytes;
+    /**
+     * Eviction limits used by aesd_circular_buffer_add_entry_evict(), 0 means no limit.
+     * max_bytes applies to stored_bytes.
+     * max_entries above AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED is capped to it.
+     */
+    size_t max_bytes;
+    unsigned int max_entries;
+    /**
+     * Entries ever added, and the seq given to the next one
+     */
+    uint64_t entries_added;
 };
 
+/**
+ * @return the bytes of memory @param entry holds in buffptr
+ */
+static inline size_t aesd_buffer_entry_stored(const struct aesd_buffer_entry *entry)
+{
+    return entry->zsize ? entry->zsize : entry->size;
+}
+
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
 extern struct aesd_buffer_entry * aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern size_t aesd_circular_buffer_add_entry_evict(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *add_entry,
+            struct aesd_buffer_entry *evicted[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED]);
+
+extern uint64_t aesd_circular_buffer_oldest_seq(const struct aesd_circular_buffer *buffer);
+
+extern long aesd_circular_buffer_seq_offset(struct aesd_circular_buffer *buffer, uint64_t seq);
+
+extern unsigned int aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer);
+
 extern long aesd_circular_buffer_offset_adjust(struct aesd_circular_buffer *buffer, size_t cmd_offset, size_t char_offset);
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
@@ -0,0 +1,76 @@
+#!/bin/sh
+# Measures the CPU cost and the ratio of keeping aesdchar records LZ4 compressed
+# Usage: aesd-compress-bench.sh [records] [record bytes] [full reads]
+# Run as root next to a built aesdchar.ko, the module is reloaded with compress=0 then 1.
+# Needs a kernel with CONFIG_LZ4_COMPRESS and CONFIG_LZ4_DECOMPRESS.
+
+set -e
+set -u
+
+NUMRECORDS=${1:-5000}
+RECORDBYTES=${2:-4096}
+NUMREADS=${3:-2000}
+DEVICE=/dev/aesdchar
+DEBUGFS=/sys/kernel/debug/aesdchar
+
+cd `dirname $0`
+if [ ! -e aesdchar.ko ]; then
+	echo "Build the module first with make"
+	exit 1
+fi
+mountpoint -q /sys/kernel/debug || mount -t debugfs none /sys/kernel/debug
+
+now() {
+	date +%s.%N
+}
+
+elapsed() {
+	awk -v start="$1" -v end="$2" 'BEGIN { printf "%.3f", end - start }'
+}
+
+value() {
+	awk -v key="$2" '$1 == key { print $2 }' "$DEBUGFS/$1"
+}
+
+for compress in 0 1; do
+	./aesdchar_unload 2>/dev/null || true
+	./aesdchar_load compress=$compress > /dev/null
+
+	# log-like records on a single line each, so every one is a single record
+	start=$(now)
+	awk -v records="$NUMRECORDS" -v bytes="$RECORDBYTES" 'BEGIN {
+		srand(42)
+		for (r = 0; r < records; r++) {
+			line = ""
+			while (length(line) < bytes - 1)
+				line = line sprintf("ts=%d level=%s req=%06d status=%d ", 1700000000 + r,
+					rand() < 0.9 ? "info" : "warn", int(rand() * 1000000), rand() < 0.95 ? 200 : 500)
+			print substr(line, 1, bytes - 1)
+		}
+	}' > "$DEVICE"
+	write_secs=$(elapsed $start $(now))
+
+	start=$(now)
+	i=0
+	while [ $i -lt $NUMREADS ]; do
+		cat "$DEVICE" > /dev/null
+		i=$((i + 1))
+	done
+	read_secs=$(elapsed $start $(now))
+
+	echo "compress=${compress}: ${NUMRECORDS} writes in ${write_secs}s, ${NUMREADS} full reads in ${read_secs}s"
+	plain=$(value ring bytes)
+	stored=$(value ring stored_bytes)
+	echo "    ring bytes ${plain}, in memory ${stored}, ratio" \
+		$(awk -v p="$plain" -v s="$stored" 'BEGIN { printf "%.2f", s > 0 ? p / s : 0 }')
+	if [ $compress -eq 1 ]; then
+		plain=$(value stats compressed_plain_total)
+		stored=$(value stats compressed_stored_total)
+		echo "    compress avg $(value stats compress_avg_ns) ns max $(value stats compress_max_ns) ns over $(value stats compress_count) records"
+		echo "    decompress avg $(value stats decompress_avg_ns) ns over $(value stats decompress_count) blocks," \
+			"cache hits $(value stats zcache_hits) misses $(value stats zcache_misses)"
+		echo "    lifetime ratio of compressed records" $(awk -v p="$plain" -v s="$stored" 'BEGIN { printf "%.2f", s > 0 ? p / s : 0 }') \
+			"(${plain} plain bytes in ${stored}, evicted ones included)"
+	fi
+done
+./aesdchar_unload
@@ -0,0 +1,175 @@
+/**
+ * @file aesd-compress.c
+ * @brief Optional LZ4 compression of stored aesdchar records
+ *
+ * Records are compressed by the writer before the ring lock is taken and only
+ * kept compressed when that saves at least an eighth of their size. Reads
+ * decompress lazily into a small cache of reference counted blocks, so a
+ * consumer walking a record with several short reads decompresses it once.
+ */
+
+#include <linux/atomic.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/lz4.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include "aesd-circular-buffer.h"
+#include "aesd-compress.h"
+#include "aesd-stats.h"
+
+#define AESD_ZCACHE_BLOCKS 4
+
+static bool compress;
+module_param(compress, bool, 0644);
+MODULE_PARM_DESC(compress, "Keep records LZ4 compressed in memory (needs CONFIG_LZ4_COMPRESS and CONFIG_LZ4_DECOMPRESS)");
+
+static unsigned int compress_min = 64;
+module_param(compress_min, uint, 0644);
+MODULE_PARM_DESC(compress_min, "Records shorter than this are never compressed");
+
+/**
+ * Most recently used decompressed blocks, replaced round robin
+ */
+static struct aesd_zblock *zcache[AESD_ZCACHE_BLOCKS];
+static unsigned int zcache_next;
+static DEFINE_SPINLOCK(zcache_lock);
+
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS) && IS_ENABLED(CONFIG_LZ4_DECOMPRESS)
+
+char *aesd_compress(const char *data, size_t len, size_t *zsize, void **workmem,
+        struct aesd_stats *stats)
+{
+    ktime_t start;
+    char *dst, *stored;
+    int bound, ret;
+
+    if (!READ_ONCE(compress) || len < compress_min || len > LZ4_MAX_INPUT_SIZE)
+        return NULL;
+    if (!*workmem) {
+        *workmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+        if (!*workmem)
+            return NULL;
+    }
+    bound = LZ4_compressBound(len);
+    dst = kvmalloc(bound, GFP_KERNEL);
+    if (!dst)
+        return NULL;
+
+    start = ktime_get();
+    ret = LZ4_compress_default(data, dst, len, bound, *workmem);
+    aesd_stat_time_add(&stats->compress, start, ktime_get());
+
+    stored = NULL;
+    if (ret > 0 && ret <= len - len / 8) {
+        stored = kmalloc(ret, GFP_KERNEL);
+        if (stored) {
+            memcpy(stored, dst, ret);
+            *zsize = ret;
+            atomic64_add(len, &stats->compressed_plain_total);
+            atomic64_add(ret, &stats->compressed_stored_total);
+        }
+    }
+    kvfree(dst);
+    return stored;
+}
+
+static struct aesd_zblock *aesd_decompress(const struct aesd_buffer_entry *entry,
+        struct aesd_stats *stats)
+{
+    struct aesd_zblock *block;
+    ktime_t start;
+    int ret;
+
+    block = kvmalloc(struct_size(block, data, entry->size), GFP_KERNEL);
+    if (!block)
+        return NULL;
+    start = ktime_get();
+    ret = LZ4_decompress_safe(entry->buffptr, block->data, entry->zsize, entry->size);
+    aesd_stat_time_add(&stats->decompress, start, ktime_get());
+    if (ret != entry->size) {
+        kvfree(block);
+        return NULL;
+    }
+    /* one reference for the cache, one for the caller */
+    atomic_set(&block->refs, 2);
+    block->seq = entry->seq;
+    block->size = entry->size;
+    return block;
+}
+
+#else
+
+char *aesd_compress(const char *data, size_t len, size_t *zsize, void **workmem,
+        struct aesd_stats *stats)
+{
+    if (READ_ONCE(compress))
+        pr_warn_once("aesdchar: built without LZ4, records are stored uncompressed\n");
+    return NULL;
+}
+
+static struct aesd_zblock *aesd_decompress(const struct aesd_buffer_entry *entry,
+        struct aesd_stats *stats)
+{
+    return NULL;
+}
+
+#endif
+
+void aesd_compress_free_workmem(void *workmem)
+{
+    kvfree(workmem);
+}
+
+void aesd_decompress_put(struct aesd_zblock *block)
+{
+    if (atomic_dec_and_test(&block->refs))
+        kvfree(block);
+}
+
+struct aesd_zblock *aesd_decompress_get(const struct aesd_buffer_entry *entry,
+        struct aesd_stats *stats)
+{
+    struct aesd_zblock *block, *old = NULL;
+    unsigned int i;
+
+    spin_lock(&zcache_lock);
+    for (i = 0; i < AESD_ZCACHE_BLOCKS; i++) {
+        block = zcache[i];
+        if (block && block->seq == entry->seq) {
+            atomic_inc(&block->refs);
+            spin_unlock(&zcache_lock);
+            atomic64_inc(&stats->zcache_hits);
+            return block;
+        }
+    }
+    spin_unlock(&zcache_lock);
+
+    /* seq never repeats, so a block cached meanwhile by another reader is just a duplicate */
+    block = aesd_decompress(entry, stats);
+    if (!block)
+        return NULL;
+    atomic64_inc(&stats->zcache_misses);
+
+    spin_lock(&zcache_lock);
+    old = zcache[zcache_next];
+    zcache[zcache_next] = block;
+    zcache_next = (zcache_next + 1) % AESD_ZCACHE_BLOCKS;
+    spin_unlock(&zcache_lock);
+    if (old)
+        aesd_decompress_put(old);
+    return block;
+}
+
+void aesd_compress_exit(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < AESD_ZCACHE_BLOCKS; i++) {
+        if (zcache[i])
+            aesd_decompress_put(zcache[i]);
+        zcache[i] = NULL;
+    }
+}
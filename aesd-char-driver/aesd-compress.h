@@ -0,0 +1,53 @@
+/*
+ * aesd-compress.h
+ *
+ *  @brief Optional LZ4 compression of stored aesdchar records
+ */
+
+#ifndef AESD_CHAR_DRIVER_AESD_COMPRESS_H_
+#define AESD_CHAR_DRIVER_AESD_COMPRESS_H_
+
+#include <linux/atomic.h>
+#include <linux/types.h>
+
+struct aesd_buffer_entry;
+struct aesd_stats;
+
+/**
+ * A decompressed record, shared by concurrent readers through a reference count
+ */
+struct aesd_zblock
+{
+    atomic_t refs;
+    u64 seq;
+    size_t size;
+    char data[];
+};
+
+/**
+ * Compress @param len bytes of @param data when compression is enabled and pays off.
+ * @param workmem is scratch memory owned by the caller, allocated on first use and released
+ *      with aesd_compress_free_workmem(). Calls sharing it must be serialized.
+ * @return a kmalloc'd buffer of *@param zsize bytes, or NULL to store the record as is
+ */
+extern char *aesd_compress(const char *data, size_t len, size_t *zsize, void **workmem,
+        struct aesd_stats *stats);
+
+extern void aesd_compress_free_workmem(void *workmem);
+
+/**
+ * Get the plain bytes of the compressed @param entry, from the cache or by decompressing it.
+ * The entry must stay in the ring until the call returns, the block stays valid until it is put.
+ * @return NULL if memory is short or the data is corrupt
+ */
+extern struct aesd_zblock *aesd_decompress_get(const struct aesd_buffer_entry *entry,
+        struct aesd_stats *stats);
+
+extern void aesd_decompress_put(struct aesd_zblock *block);
+
+/**
+ * Drop the blocks left in the decompression cache.
+ */
+extern void aesd_compress_exit(void);
+
+#endif /* AESD_CHAR_DRIVER_AESD_COMPRESS_H_ */
@@ -0,0 +1,383 @@
+/**
+ * @file aesd-persist.c
+ * @brief Write-behind persistence of the aesdchar circular buffer
+ *
+ * Committed records are queued by aesd_write() and stored by a kernel thread
+ * in a fixed size backing file used as an on-disk ring. Every record carries
+ * a sequence number and a crc32, so records torn by a crash or partly
+ * overwritten after a wrap are skipped when the file is scanned on load.
+ */
+
+#include <linux/crc32.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/kthread.h>
+#include <linux/list.h>
+#include <linux/module.h>
+#include <linux/printk.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include "aesdchar.h"
+#include "aesd-persist.h"
+
+static char *persist_path;
+module_param(persist_path, charp, 0444);
+MODULE_PARM_DESC(persist_path, "Backing file for the record history, unset disables persistence");
+
+static unsigned int persist_records = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(persist_records, uint, 0444);
+MODULE_PARM_DESC(persist_records, "Most recent records reloaded into the buffer on load");
+
+static unsigned int persist_size = 1024 * 1024;
+module_param(persist_size, uint, 0444);
+MODULE_PARM_DESC(persist_size, "Size in bytes of the on-disk record ring");
+
+static unsigned int persist_backlog = 256 * 1024;
+module_param(persist_backlog, uint, 0644);
+MODULE_PARM_DESC(persist_backlog, "Bytes queued for the writer thread before records are dropped");
+
+#define AESD_PERSIST_MAGIC 0x44534541 /* "AESD" */
+
+struct aesd_persist_hdr
+{
+    __le32 magic;
+    __le32 size;
+    __le64 seq;
+    __le64 timestamp_ns;
+    /**
+     * crc32 of the header, with this field zeroed, followed by the data
+     */
+    __le32 crc;
+    __le32 reserved;
+};
+
+struct aesd_persist_record
+{
+    struct list_head list;
+    u64 seq;
+    u64 timestamp_ns;
+    size_t size;
+    char data[];
+};
+
+/**
+ * A valid record found while scanning the backing file
+ */
+struct aesd_persist_slot
+{
+    u64 seq;
+    u64 timestamp_ns;
+    u32 offset;
+    u32 size;
+};
+
+struct aesd_persist
+{
+    struct file *file;
+    struct task_struct *thread;
+    wait_queue_head_t wait;
+    /**
+     * Protects pending, backlog and dropped
+     */
+    spinlock_t lock;
+    struct list_head pending;
+    size_t backlog;
+    unsigned long dropped;
+    /**
+     * Next write offset in the backing file, only touched by the writer
+     */
+    loff_t head;
+};
+
+static u32 aesd_persist_crc(const struct aesd_persist_hdr *hdr, const char *data, size_t size)
+{
+    struct aesd_persist_hdr tmp = *hdr;
+    u32 crc;
+
+    tmp.crc = 0;
+    crc = crc32_le(~0, (const unsigned char *) &tmp, sizeof(tmp));
+    return crc32_le(crc, (const unsigned char *) data, size);
+}
+
+struct aesd_persist_record *aesd_persist_prepare(struct aesd_persist *persist,
+        const char *data, size_t size)
+{
+    struct aesd_persist_record *rec = NULL;
+
+    if (!persist)
+        return NULL;
+    if (size <= persist_size - sizeof(struct aesd_persist_hdr))
+        rec = kmalloc(struct_size(rec, data, size), GFP_KERNEL);
+    if (!rec) {
+        spin_lock(&persist->lock);
+        persist->dropped++;
+        spin_unlock(&persist->lock);
+        return NULL;
+    }
+    memcpy(rec->data, data, size);
+    rec->size = size;
+    return rec;
+}
+
+void aesd_persist_commit(struct aesd_persist *persist, struct aesd_persist_record *rec,
+        const struct aesd_buffer_entry *entry)
+{
+    size_t size;
+
+    if (!rec)
+        return;
+    size = rec->size;
+    rec->seq = entry->seq;
+    rec->timestamp_ns = entry->timestamp_ns;
+
+    spin_lock(&persist->lock);
+    if (persist->backlog + size > persist_backlog) {
+        /* the disk is not keeping up, the producer must not wait for it */
+        persist->dropped++;
+        spin_unlock(&persist->lock);
+        kfree(rec);
+        return;
+    }
+    list_add_tail(&rec->list, &persist->pending);
+    persist->backlog += size;
+    spin_unlock(&persist->lock);
+
+    wake_up_interruptible(&persist->wait);
+}
+
+static int aesd_persist_write_record(struct aesd_persist *persist, const struct aesd_persist_record *rec)
+{
+    struct aesd_persist_hdr hdr;
+    loff_t pos;
+    ssize_t ret;
+
+    /* wrap instead of splitting a record, whatever it overwrites fails its crc */
+    if (persist->head + sizeof(hdr) + rec->size > persist_size)
+        persist->head = 0;
+
+    hdr.magic = cpu_to_le32(AESD_PERSIST_MAGIC);
+    hdr.size = cpu_to_le32(rec->size);
+    hdr.seq = cpu_to_le64(rec->seq);
+    hdr.timestamp_ns = cpu_to_le64(rec->timestamp_ns);
+    hdr.reserved = 0;
+    hdr.crc = cpu_to_le32(aesd_persist_crc(&hdr, rec->data, rec->size));
+
+    pos = persist->head;
+    ret = kernel_write(persist->file, &hdr, sizeof(hdr), &pos);
+    if (ret == sizeof(hdr))
+        ret = kernel_write(persist->file, rec->data, rec->size, &pos);
+    if (ret < 0)
+        return ret;
+    persist->head = pos;
+    return 0;
+}
+
+/**
+ * Write everything queued so far as one batch followed by a single fdatasync.
+ */
+static void aesd_persist_flush(struct aesd_persist *persist)
+{
+    LIST_HEAD(batch);
+    struct aesd_persist_record *rec, *tmp;
+    int ret;
+
+    spin_lock(&persist->lock);
+    list_splice_init(&persist->pending, &batch);
+    persist->backlog = 0;
+    spin_unlock(&persist->lock);
+
+    if (list_empty(&batch))
+        return;
+
+    list_for_each_entry_safe(rec, tmp, &batch, list) {
+        ret = aesd_persist_write_record(persist, rec);
+        if (ret)
+            printk_ratelimited(KERN_WARNING "aesdchar: persisting record %llu failed: %d\n", rec->seq, ret);
+        list_del(&rec->list);
+        kfree(rec);
+    }
+    vfs_fsync(persist->file, 1);
+}
+
+static int aesd_persist_thread(void *data)
+{
+    struct aesd_persist *persist = data;
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible(persist->wait,
+                !list_empty(&persist->pending) || kthread_should_stop());
+        aesd_persist_flush(persist);
+    }
+    return 0;
+}
+
+static int aesd_persist_slot_cmp(const void *a, const void *b)
+{
+    const struct aesd_persist_slot *sa = a, *sb = b;
+
+    if (sa->seq < sb->seq)
+        return -1;
+    return sa->seq > sb->seq;
+}
+
+/**
+ * Scan the backing file and put its newest persist_records records into the ring.
+ */
+static int aesd_persist_load(struct aesd_persist *persist, struct aesd_dev *dev)
+{
+    struct aesd_persist_slot *slots = NULL, *grown;
+    size_t nslots = 0, capslots = 0, first, i;
+    struct aesd_persist_hdr hdr;
+    loff_t size, pos = 0;
+    size_t off = 0;
+    char *buf;
+    u32 len;
+    int ret = 0;
+
+    size = i_size_read(file_inode(persist->file));
+    if (size > persist_size)
+        size = persist_size;
+    if (size < sizeof(hdr))
+        return 0;
+
+    buf = vmalloc(size);
+    if (!buf)
+        return -ENOMEM;
+    if (kernel_read(persist->file, buf, size, &pos) != size) {
+        ret = -EIO;
+        goto out;
+    }
+
+    while (off + sizeof(hdr) <= size) {
+        memcpy(&hdr, buf + off, sizeof(hdr));
+        len = le32_to_cpu(hdr.size);
+        if (le32_to_cpu(hdr.magic) != AESD_PERSIST_MAGIC ||
+                len > size - off - sizeof(hdr) ||
+                le32_to_cpu(hdr.crc) != aesd_persist_crc(&hdr, buf + off + sizeof(hdr), len)) {
+            /* torn or overwritten, resync on the next byte */
+            off++;
+            continue;
+        }
+        if (nslots == capslots) {
+            capslots = capslots ? capslots * 2 : 64;
+            grown = krealloc(slots, capslots * sizeof(*slots), GFP_KERNEL);
+            if (!grown) {
+                ret = -ENOMEM;
+                goto out;
+            }
+            slots = grown;
+        }
+        slots[nslots].seq = le64_to_cpu(hdr.seq);
+        slots[nslots].timestamp_ns = le64_to_cpu(hdr.timestamp_ns);
+        slots[nslots].offset = off;
+        slots[nslots].size = len;
+        nslots++;
+        off += sizeof(hdr) + len;
+    }
+    if (!nslots)
+        goto out;
+
+    sort(slots, nslots, sizeof(*slots), aesd_persist_slot_cmp, NULL);
+    first = nslots > persist_records ? nslots - persist_records : 0;
+    for (i = first; i < nslots; i++) {
+        struct aesd_buffer_entry *entry, *evicted[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+        size_t nevicted, j;
+        char *data;
+
+        entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+        data = kmalloc(slots[i].size, GFP_KERNEL);
+        if (!entry || !data) {
+            kfree(entry);
+            kfree(data);
+            ret = -ENOMEM;
+            goto out;
+        }
+        memcpy(data, buf + slots[i].offset + sizeof(hdr), slots[i].size);
+        entry->buffptr = data;
+        entry->size = slots[i].size;
+        entry->zsize = 0;
+        entry->timestamp_ns = slots[i].timestamp_ns;
+        // keep the original numbering, add_entry assigns entries_added as the seq
+        dev->dev_buff->entries_added = slots[i].seq;
+        nevicted = aesd_circular_buffer_add_entry_evict(dev->dev_buff, entry, evicted);
+        for (j = 0; j < nevicted; j++) {
+            kfree(evicted[j]->buffptr);
+            kfree(evicted[j]);
+        }
+    }
+
+    /* continue the on-disk ring right after the newest record */
+    persist->head = slots[nslots - 1].offset + sizeof(hdr) + slots[nslots - 1].size;
+    printk(KERN_INFO "aesdchar: restored %zu of %zu persisted records\n", nslots - first, nslots);
+
+out:
+    kfree(slots);
+    vfree(buf);
+    return ret;
+}
+
+int aesd_persist_init(struct aesd_dev *dev)
+{
+    struct aesd_persist *persist;
+    int ret;
+
+    if (!persist_path || !*persist_path)
+        return 0;
+    if (persist_size < 2 * sizeof(struct aesd_persist_hdr))
+        return -EINVAL;
+
+    persist = kzalloc(sizeof(*persist), GFP_KERNEL);
+    if (!persist)
+        return -ENOMEM;
+    spin_lock_init(&persist->lock);
+    init_waitqueue_head(&persist->wait);
+    INIT_LIST_HEAD(&persist->pending);
+
+    persist->file = filp_open(persist_path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if (IS_ERR(persist->file)) {
+        ret = PTR_ERR(persist->file);
+        printk(KERN_ERR "aesdchar: cannot open %s: %d\n", persist_path, ret);
+        goto fail_free;
+    }
+
+    ret = aesd_persist_load(persist, dev);
+    if (ret) {
+        printk(KERN_ERR "aesdchar: cannot reload %s: %d\n", persist_path, ret);
+        goto fail_close;
+    }
+
+    persist->thread = kthread_run(aesd_persist_thread, persist, "aesdchar-persist");
+    if (IS_ERR(persist->thread)) {
+        ret = PTR_ERR(persist->thread);
+        goto fail_close;
+    }
+
+    dev->persist = persist;
+    return 0;
+
+fail_close:
+    filp_close(persist->file, NULL);
+fail_free:
+    kfree(persist);
+    return ret;
+}
+
+void aesd_persist_exit(struct aesd_dev *dev)
+{
+    struct aesd_persist *persist = dev->persist;
+
+    if (!persist)
+        return;
+
+    kthread_stop(persist->thread);
+    /* the thread may have been stopped before it ever ran */
+    aesd_persist_flush(persist);
+    filp_close(persist->file, NULL);
+    if (persist->dropped)
+        printk(KERN_WARNING "aesdchar: %lu records were not persisted\n", persist->dropped);
+    kfree(persist);
+    dev->persist = NULL;
+}
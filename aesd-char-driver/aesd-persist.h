@@ -0,0 +1,48 @@
+/*
+ * aesd-persist.h
+ *
+ *  @brief Write-behind persistence of committed aesdchar records
+ */
+
+#ifndef AESD_CHAR_DRIVER_AESD_PERSIST_H_
+#define AESD_CHAR_DRIVER_AESD_PERSIST_H_
+
+#include <linux/types.h>
+
+struct aesd_dev;
+struct aesd_persist;
+struct aesd_persist_record;
+struct aesd_buffer_entry;
+
+/**
+ * Open the backing file, reload its most recent records into @param dev ring
+ * with their original sequence numbers and start the writer thread. Does nothing when persistence is disabled.
+ * Must run before the device is visible to user space.
+ * @return 0 on success or when disabled, negative errno otherwise
+ */
+extern int aesd_persist_init(struct aesd_dev *dev);
+
+/**
+ * Copy the @param size plain bytes of @param data of a record about to be committed, so the
+ * allocation and the copy happen before the record is linked into the ring.
+ * @return the copy to pass to aesd_persist_commit(), NULL when persistence is disabled or the
+ *      record is dropped
+ */
+extern struct aesd_persist_record *aesd_persist_prepare(struct aesd_persist *persist,
+        const char *data, size_t size);
+
+/**
+ * Queue @param rec, prepared for the committed @param entry, with its seq and timestamp
+ * for the writer thread. Takes ownership of @param rec, which may be NULL.
+ * Never waits for disk, records are dropped if the backlog is full.
+ * Must be called in commit order, as soon as the entry is linked in.
+ */
+extern void aesd_persist_commit(struct aesd_persist *persist, struct aesd_persist_record *rec,
+        const struct aesd_buffer_entry *entry);
+
+/**
+ * Flush what is queued and stop the writer thread.
+ */
+extern void aesd_persist_exit(struct aesd_dev *dev);
+
+#endif /* AESD_CHAR_DRIVER_AESD_PERSIST_H_ */
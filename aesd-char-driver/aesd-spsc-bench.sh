@@ -0,0 +1,71 @@
+#!/bin/sh
+# Compares locked and lock-free ring access under one writer and one reader loop
+# Usage: aesd-spsc-bench.sh [writes per run] [packet bytes]
+# Run as root next to a built aesdchar.ko, the module is reloaded for each mode.
+
+set -e
+set -u
+
+NUMWRITES=${1:-20000}
+PACKETBYTES=${2:-64}
+DEVICE=/dev/aesdchar
+DEBUGFS=/sys/kernel/debug/aesdchar
+
+cd `dirname $0`
+if [ ! -e aesdchar.ko ]; then
+	echo "Build the module first with make"
+	exit 1
+fi
+mountpoint -q /sys/kernel/debug || mount -t debugfs none /sys/kernel/debug
+
+now() {
+	date +%s.%N
+}
+
+elapsed() {
+	awk -v start="$1" -v end="$2" 'BEGIN { printf "%.3f", end - start }'
+}
+
+rate() {
+	awk -v count="$1" -v secs="$2" 'BEGIN { printf "%.0f", secs > 0 ? count / secs : 0 }'
+}
+
+packet=$(head -c $((PACKETBYTES - 1)) /dev/zero | tr '\0' 'x')
+readcount=$(mktemp)
+trap 'rm -f "$readcount" "$readcount.stop"' EXIT
+
+for mode in 0 1; do
+	./aesdchar_unload 2>/dev/null || true
+	./aesdchar_load spsc=$mode > /dev/null
+
+	# read-only openers come and go without leaving the lock-free mode
+	(
+		reads=0
+		while [ ! -e "$readcount.stop" ]; do
+			cat "$DEVICE" > /dev/null
+			reads=$((reads + 1))
+		done
+		echo $reads > "$readcount"
+	) &
+	reader=$!
+
+	# the single write-only opener, each printf is one commit
+	start=$(now)
+	exec 3> "$DEVICE"
+	i=0
+	while [ $i -lt $NUMWRITES ]; do
+		printf '%s\n' "$packet" >&3
+		i=$((i + 1))
+	done
+	exec 3>&-
+	secs=$(elapsed $start $(now))
+
+	touch "$readcount.stop"
+	wait $reader
+	rm -f "$readcount.stop"
+	reads=$(cat "$readcount")
+
+	echo "spsc=${mode}: ${NUMWRITES} writes in ${secs}s ($(rate $NUMWRITES $secs)/s), ${reads} full reads ($(rate $reads $secs)/s)"
+	grep -E '^(commit|lock_wait|lock_hold)_avg_ns' "$DEBUGFS/stats" | sed 's/^/    /'
+done
+./aesdchar_unload
@@ -0,0 +1,215 @@
+/**
+ * @file aesd-spsc.c
+ * @brief Lock-free access to the aesdchar ring while one writer and one reader are attached
+ *
+ * With a single write-only opener, the writer owns the ring and publishes each
+ * commit through a seqcount, so readers can snapshot the ring without ring_lock.
+ * Readers take turns on reader_lock, so one reader_active flag covers all of
+ * them and read-only openers never change the mode. Entries evicted while the
+ * reader flags itself active are kept until a later commit finds it inactive:
+ * the reader sets reader_active before taking its snapshot and the writer tests
+ * it after unlinking, each with a full barrier in between, so at least one of
+ * them sees the other.
+ *
+ * A second writer, or any read-write opener, switches to ring_lock. Leaving the
+ * lock-free mode takes ring_lock for write and waits for lock-free operations
+ * to drain, while locked operations recheck the mode once they hold ring_lock.
+ */
+
+#include <linux/atomic.h>
+#include <linux/fs.h>
+#include <linux/module.h>
+#include <linux/preempt.h>
+#include <linux/slab.h>
+#include <linux/wait_bit.h>
+#include "aesdchar.h"
+#include "aesd-persist.h"
+#include "aesd-spsc.h"
+
+static bool spsc = true;
+module_param(spsc, bool, 0644);
+MODULE_PARM_DESC(spsc, "Bypass ring_lock while exactly one writer, opened write-only, is attached");
+
+void aesd_spsc_init(struct aesd_dev *dev)
+{
+    struct aesd_spsc *s = &dev->spsc;
+
+    atomic_set(&s->inflight, 0);
+    init_waitqueue_head(&s->quiesce);
+    seqcount_init(&s->seq);
+    mutex_init(&s->reader_lock);
+    mutex_init(&s->mode_lock);
+}
+
+static bool aesd_spsc_enter(struct aesd_spsc *s)
+{
+    atomic_inc(&s->inflight);
+    smp_mb__after_atomic();
+    if (READ_ONCE(s->enabled))
+        return true;
+    atomic_dec(&s->inflight);
+    return false;
+}
+
+static void aesd_spsc_leave(struct aesd_spsc *s)
+{
+    /* the full barrier of the decrement pairs with the one in aesd_spsc_switch() */
+    if (atomic_dec_and_test(&s->inflight) && !READ_ONCE(s->enabled))
+        wake_up(&s->quiesce);
+}
+
+static void aesd_spsc_free(struct aesd_buffer_entry **entries, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        kfree(entries[i]->buffptr);
+        kfree(entries[i]);
+    }
+}
+
+static void aesd_spsc_switch(struct aesd_dev *dev, bool enable)
+{
+    struct aesd_spsc *s = &dev->spsc;
+
+    down_write(&dev->ring_lock);
+    WRITE_ONCE(s->enabled, enable);
+    if (!enable) {
+        smp_mb();
+        wait_event(s->quiesce, atomic_read(&s->inflight) == 0);
+        aesd_spsc_free(s->deferred, s->ndeferred);
+        s->ndeferred = 0;
+    }
+    up_write(&dev->ring_lock);
+    PDEBUG("lock-free ring access %s", enable ? "on" : "off");
+}
+
+static void aesd_spsc_update(struct aesd_dev *dev)
+{
+    struct aesd_spsc *s = &dev->spsc;
+    /* readers are serialized on reader_lock in the lock-free mode, however many there are */
+    bool enable = READ_ONCE(spsc) && s->readwriters == 0 && s->writers == 1;
+
+    if (enable != s->enabled)
+        aesd_spsc_switch(dev, enable);
+}
+
+/* only called for openers with FMODE_WRITE */
+static unsigned int *aesd_spsc_counter(struct aesd_spsc *s, fmode_t fmode)
+{
+    if (fmode & FMODE_READ)
+        return &s->readwriters;
+    return &s->writers;
+}
+
+void aesd_spsc_open(struct aesd_dev *dev, fmode_t fmode)
+{
+    /* short-lived readers, one per aesdsocket client, must not cost a mode switch each */
+    if (!(fmode & FMODE_WRITE))
+        return;
+    mutex_lock(&dev->spsc.mode_lock);
+    (*aesd_spsc_counter(&dev->spsc, fmode))++;
+    aesd_spsc_update(dev);
+    mutex_unlock(&dev->spsc.mode_lock);
+}
+
+void aesd_spsc_release(struct aesd_dev *dev, fmode_t fmode)
+{
+    if (!(fmode & FMODE_WRITE))
+        return;
+    mutex_lock(&dev->spsc.mode_lock);
+    (*aesd_spsc_counter(&dev->spsc, fmode))--;
+    aesd_spsc_update(dev);
+    mutex_unlock(&dev->spsc.mode_lock);
+}
+
+bool aesd_spsc_commit(struct aesd_dev *dev, struct aesd_buffer_entry *entry,
+        struct aesd_persist_record *rec, struct aesd_buffer_entry **evicted, size_t *nevicted)
+{
+    struct aesd_spsc *s = &dev->spsc;
+    size_t first = *nevicted, n;
+
+    if (!aesd_spsc_enter(s))
+        return false;
+
+    entry->timestamp_ns = ktime_get_real_ns();
+    preempt_disable();
+    raw_write_seqcount_begin(&s->seq);
+    n = aesd_circular_buffer_add_entry_evict(dev->dev_buff, entry, evicted + first);
+    raw_write_seqcount_end(&s->seq);
+    preempt_enable();
+    aesd_persist_commit(dev->persist, rec, entry);
+    aesd_stats_evicted(&dev->stats, evicted + first, n);
+
+    /* pairs with the barrier in aesd_ring_read_begin() */
+    smp_mb();
+    if (READ_ONCE(s->reader_active)) {
+        if (s->ndeferred + n > AESD_SPSC_DEFERRED) {
+            wait_var_event(&s->reader_active, !READ_ONCE(s->reader_active));
+            aesd_spsc_free(s->deferred, s->ndeferred);
+            s->ndeferred = 0;
+        }
+        memcpy(s->deferred + s->ndeferred, evicted + first, n * sizeof(*evicted));
+        s->ndeferred += n;
+        /* the caller only frees what it gets back */
+        n = 0;
+    } else if (s->ndeferred) {
+        aesd_spsc_free(s->deferred, s->ndeferred);
+        s->ndeferred = 0;
+    }
+    *nevicted += n;
+
+    aesd_spsc_leave(s);
+    return true;
+}
+
+void aesd_ring_read_begin(struct aesd_dev *dev, struct aesd_ring_view *view)
+{
+    struct aesd_spsc *s = &dev->spsc;
+    unsigned int seq;
+
+    for (;;) {
+        view->lockless = aesd_spsc_enter(s);
+        if (view->lockless)
+            break;
+        down_read(&dev->ring_lock);
+        /* the mode only changes under ring_lock, it may have been enabled since the check */
+        if (!READ_ONCE(s->enabled)) {
+            view->buffer = dev->dev_buff;
+            return;
+        }
+        up_read(&dev->ring_lock);
+    }
+
+    mutex_lock(&s->reader_lock);
+    WRITE_ONCE(s->reader_active, 1);
+    /* pairs with the barrier in aesd_spsc_commit() */
+    smp_mb();
+    do {
+        seq = read_seqcount_begin(&s->seq);
+        view->snapshot = *dev->dev_buff;
+    } while (read_seqcount_retry(&s->seq, seq));
+    view->buffer = &view->snapshot;
+}
+
+void aesd_ring_read_end(struct aesd_dev *dev, struct aesd_ring_view *view)
+{
+    struct aesd_spsc *s = &dev->spsc;
+
+    if (!view->lockless) {
+        up_read(&dev->ring_lock);
+        return;
+    }
+    smp_store_release(&s->reader_active, 0);
+    wake_up_var(&s->reader_active);
+    mutex_unlock(&s->reader_lock);
+    aesd_spsc_leave(s);
+}
+
+void aesd_spsc_exit(struct aesd_dev *dev)
+{
+    struct aesd_spsc *s = &dev->spsc;
+
+    aesd_spsc_free(s->deferred, s->ndeferred);
+    s->ndeferred = 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * aesd-spsc.h
+ *
+ *  @brief Lock-free access to the aesdchar ring while a single writer is attached
+ */
+
+#ifndef AESD_CHAR_DRIVER_AESD_SPSC_H_
+#define AESD_CHAR_DRIVER_AESD_SPSC_H_
+
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+#include "aesd-circular-buffer.h"
+
+struct aesd_dev;
+struct aesd_persist_record;
+
+#define AESD_SPSC_DEFERRED (4 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+
+struct aesd_spsc
+{
+    /**
+     * True while commits and reads bypass ring_lock, only changed with ring_lock held for write
+     */
+    bool enabled;
+    /**
+     * Operations running without ring_lock, drained before leaving the lock-free mode
+     */
+    atomic_t inflight;
+    wait_queue_head_t quiesce;
+    /**
+     * Makes the ring fields a consistent snapshot for readers, written by the single writer
+     */
+    seqcount_t seq;
+    /**
+     * Serializes lock-free readers, so one reader_active flag is enough however many
+     * files read. Concurrent readers take turns here instead of sharing ring_lock.
+     */
+    struct mutex reader_lock;
+    /**
+     * Set while a reader may dereference entries, the writer then defers freeing evictions
+     */
+    int reader_active;
+    struct aesd_buffer_entry *deferred[AESD_SPSC_DEFERRED];
+    size_t ndeferred;
+    /**
+     * Writing openers by access mode, protected by mode_lock. Read-only ones do not
+     * matter to the mode, so they are not counted.
+     */
+    struct mutex mode_lock;
+    unsigned int writers;
+    unsigned int readwriters;
+};
+
+/**
+ * What a reader sees of the ring between aesd_ring_read_begin() and aesd_ring_read_end()
+ */
+struct aesd_ring_view
+{
+    const struct aesd_circular_buffer *buffer;
+    struct aesd_circular_buffer snapshot;
+    bool lockless;
+};
+
+extern void aesd_spsc_init(struct aesd_dev *dev);
+
+/**
+ * Account an opener with @param fmode and switch modes if the lock-free one no longer or now applies.
+ * Read-only openers never switch it.
+ */
+extern void aesd_spsc_open(struct aesd_dev *dev, fmode_t fmode);
+extern void aesd_spsc_release(struct aesd_dev *dev, fmode_t fmode);
+
+/**
+ * Link @param entry into the ring without ring_lock if the lock-free mode is on, and queue
+ * its persisted copy @param rec. Evictions are accounted, and the evicted entries appended
+ * to @param evicted unless a reader may still use them, in which case they are freed on a
+ * later commit.
+ * @return false if the caller must commit under ring_lock instead, @param rec is then untouched
+ */
+extern bool aesd_spsc_commit(struct aesd_dev *dev, struct aesd_buffer_entry *entry,
+        struct aesd_persist_record *rec, struct aesd_buffer_entry **evicted, size_t *nevicted);
+
+/**
+ * Pin the ring for reading, either under ring_lock or as a lock-free snapshot.
+ * Entries in @param view stay allocated until aesd_ring_read_end().
+ */
+extern void aesd_ring_read_begin(struct aesd_dev *dev, struct aesd_ring_view *view);
+extern void aesd_ring_read_end(struct aesd_dev *dev, struct aesd_ring_view *view);
+
+/**
+ * Free evictions still deferred, once no more lock-free operations can run.
+ */
+extern void aesd_spsc_exit(struct aesd_dev *dev);
+
+#endif /* AESD_CHAR_DRIVER_AESD_SPSC_H_ */
@@ -0,0 +1,112 @@
+/**
+ * @file aesd-stats.c
+ * @brief debugfs view of the aesdchar counters and ring state
+ *
+ * Counters are plain atomics updated on the hot paths, the stats file only
+ * formats a snapshot of them when it is read. The ring file describes the
+ * circular buffer so it can be monitored without draining the device.
+ */
+
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include "aesdchar.h"
+#include "aesd-spsc.h"
+#include "aesd-stats.h"
+
+static void aesd_stats_show_time(struct seq_file *s, const char *name, struct aesd_stat_time *stat)
+{
+    u64 count = atomic64_read(&stat->count);
+    u64 total = atomic64_read(&stat->total_ns);
+
+    seq_printf(s, "%s_count %llu\n", name, count);
+    seq_printf(s, "%s_avg_ns %llu\n", name, count ? div64_u64(total, count) : 0);
+    seq_printf(s, "%s_max_ns %lld\n", name, (s64) atomic64_read(&stat->max_ns));
+}
+
+static int aesd_stats_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+    struct aesd_stats *stats = &dev->stats;
+    u64 reads = atomic64_read(&stats->reads);
+    u64 entries = atomic64_read(&stats->read_entries);
+    struct aesd_ring_view view;
+    int ring_bytes;
+
+    aesd_ring_read_begin(dev, &view);
+    ring_bytes = view.buffer->size;
+    aesd_ring_read_end(dev, &view);
+
+    aesd_stats_show_time(s, "commit", &stats->commit);
+    aesd_stats_show_time(s, "lock_wait", &stats->lock_wait);
+    aesd_stats_show_time(s, "lock_hold", &stats->lock_hold);
+    seq_printf(s, "evictions %lld\n", (s64) atomic64_read(&stats->evictions));
+    seq_printf(s, "evicted_bytes %lld\n", (s64) atomic64_read(&stats->evicted_bytes));
+    /* logical bytes in the ring, the ring file has what they take in memory */
+    seq_printf(s, "ring_bytes %d\n", ring_bytes);
+    seq_printf(s, "reads %llu\n", reads);
+    seq_printf(s, "read_bytes %lld\n", (s64) atomic64_read(&stats->read_bytes));
+    /* hundredths, so the ratio survives integer formatting */
+    seq_printf(s, "entries_per_read_x100 %llu\n", reads ? div64_u64(entries * 100, reads) : 0);
+    aesd_stats_show_time(s, "compress", &stats->compress);
+    aesd_stats_show_time(s, "decompress", &stats->decompress);
+    seq_printf(s, "compressed_plain_total %lld\n", (s64) atomic64_read(&stats->compressed_plain_total));
+    seq_printf(s, "compressed_stored_total %lld\n", (s64) atomic64_read(&stats->compressed_stored_total));
+    seq_printf(s, "zcache_hits %lld\n", (s64) atomic64_read(&stats->zcache_hits));
+    seq_printf(s, "zcache_misses %lld\n", (s64) atomic64_read(&stats->zcache_misses));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+static int aesd_ring_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+    struct aesd_circular_buffer *buffer = dev->dev_buff;
+    struct aesd_ring_view view;
+    s64 pending = atomic64_read(&dev->pending_bytes);
+    unsigned int count;
+    u64 added, oldest;
+    int bytes;
+    size_t stored;
+    u8 in_offs, out_offs;
+
+    /* one consistent view, the lock-free writer never takes ring_lock */
+    aesd_ring_read_begin(dev, &view);
+    count = aesd_circular_buffer_count(view.buffer);
+    bytes = view.buffer->size;
+    stored = view.buffer->stored_bytes;
+    added = view.buffer->entries_added;
+    oldest = aesd_circular_buffer_oldest_seq(view.buffer);
+    in_offs = view.buffer->in_offs;
+    out_offs = view.buffer->out_offs;
+    aesd_ring_read_end(dev, &view);
+
+    seq_printf(s, "entries %u\n", count);
+    seq_printf(s, "max_entries %u\n", buffer->max_entries);
+    seq_printf(s, "bytes %d\n", bytes);
+    seq_printf(s, "stored_bytes %zu\n", stored);
+    seq_printf(s, "max_bytes %zu\n", buffer->max_bytes);
+    seq_printf(s, "pending_bytes %lld\n", pending);
+    seq_printf(s, "in_offs %u\n", in_offs);
+    seq_printf(s, "out_offs %u\n", out_offs);
+    /* write indexes count every record ever committed, -1 while the ring is empty */
+    seq_printf(s, "oldest_write_index %lld\n", count ? (s64) oldest : -1);
+    seq_printf(s, "newest_write_index %lld\n", count ? (s64) (added - 1) : -1);
+    seq_printf(s, "evictions %lld\n", (s64) atomic64_read(&dev->stats.evictions));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_ring);
+
+void aesd_stats_init(struct aesd_dev *dev)
+{
+    dev->debugfs = debugfs_create_dir("aesdchar", NULL);
+    debugfs_create_file("stats", 0444, dev->debugfs, dev, &aesd_stats_fops);
+    debugfs_create_file("ring", 0444, dev->debugfs, dev, &aesd_ring_fops);
+}
+
+void aesd_stats_exit(struct aesd_dev *dev)
+{
+    debugfs_remove_recursive(dev->debugfs);
+    dev->debugfs = NULL;
+}
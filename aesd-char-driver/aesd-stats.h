@@ -0,0 +1,73 @@
+/*
+ * aesd-stats.h
+ *
+ *  @brief Counters and ring state of the aesdchar driver, exported through debugfs
+ */
+
+#ifndef AESD_CHAR_DRIVER_AESD_STATS_H_
+#define AESD_CHAR_DRIVER_AESD_STATS_H_
+
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/types.h>
+#include "aesd-circular-buffer.h"
+
+struct aesd_dev;
+
+/**
+ * A latency accumulator, times in nanoseconds
+ */
+struct aesd_stat_time
+{
+    atomic64_t count;
+    atomic64_t total_ns;
+    atomic64_t max_ns;
+};
+
+struct aesd_stats
+{
+    struct aesd_stat_time commit;       /* record allocation, ring insert and persist queueing */
+    struct aesd_stat_time lock_wait;    /* time commits spent waiting for ring_lock */
+    struct aesd_stat_time lock_hold;    /* time commits held ring_lock */
+    atomic64_t evictions;
+    atomic64_t evicted_bytes;
+    atomic64_t reads;
+    atomic64_t read_bytes;
+    atomic64_t read_entries;            /* ring entries touched by all reads */
+    struct aesd_stat_time compress;     /* LZ4 compression of records, also when not kept */
+    struct aesd_stat_time decompress;   /* LZ4 decompression on cache misses */
+    atomic64_t compressed_plain_total;  /* plain size of every record ever kept compressed */
+    atomic64_t compressed_stored_total; /* what they were compressed to, neither drops on eviction */
+    atomic64_t zcache_hits;
+    atomic64_t zcache_misses;
+};
+
+static inline void aesd_stat_time_add(struct aesd_stat_time *stat, ktime_t start, ktime_t end)
+{
+    s64 ns = ktime_to_ns(ktime_sub(end, start));
+    s64 max = atomic64_read(&stat->max_ns);
+
+    atomic64_inc(&stat->count);
+    atomic64_add(ns, &stat->total_ns);
+    while (ns > max && !atomic64_try_cmpxchg(&stat->max_ns, &max, ns))
+        ;
+}
+
+static inline void aesd_stats_evicted(struct aesd_stats *stats, struct aesd_buffer_entry **evicted, size_t n)
+{
+    size_t i;
+
+    atomic64_add(n, &stats->evictions);
+    for (i = 0; i < n; i++)
+        atomic64_add(evicted[i]->size, &stats->evicted_bytes);
+}
+
+/**
+ * Create the aesdchar debugfs directory with its stats and ring files.
+ * Failure only loses the introspection, so nothing is returned.
+ */
+extern void aesd_stats_init(struct aesd_dev *dev);
+
+extern void aesd_stats_exit(struct aesd_dev *dev);
+
+#endif /* AESD_CHAR_DRIVER_AESD_STATS_H_ */
@@ -33,14 +33,59 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Passed to AESDCHAR_IOCQUERYOFFS, which resolves the same position as
+ * AESDCHAR_IOCSEEKTO but reports it instead of moving the file position,
+ * so threads sharing one descriptor can pread() from it independently.
+ */
+struct aesd_offset_query {
+    /**
+     * The zero referenced write command to seek into
+     */
+    uint32_t write_cmd;
+    /**
+     * The zero referenced offset within the write
+     */
+    uint32_t write_cmd_offset;
+    /**
+     * Set by the driver to the matching offset in the device
+     */
+    uint64_t offset;
+};
+
+/**
+ * Passed to AESDCHAR_IOCSEEKSEQ to resume reading at a record identified by its
+ * sequence number, which unlike write_cmd does not shift as old records are evicted.
+ */
+struct aesd_seekseq {
+    /**
+     * Sequence number of the record to seek to, the next sequence number seeks to the end
+     */
+    uint64_t seq;
+    /**
+     * Set by the driver to the offset of that record, which is also the new file position
+     */
+    uint64_t offset;
+    /**
+     * Set by the driver, also when seq was evicted, to the oldest sequence number still held
+     * and to the one the next record will get
+     */
+    uint64_t oldest_seq;
+    uint64_t next_seq;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Same lookup as AESDCHAR_IOCSEEKTO, returned in the offset field without touching f_pos
+#define AESDCHAR_IOCQUERYOFFS _IOWR(AESD_IOC_MAGIC, 2, struct aesd_offset_query)
+// Seek to a record by sequence number, fails with ERANGE once it was evicted
+#define AESDCHAR_IOCSEEKSEQ _IOWR(AESD_IOC_MAGIC, 3, struct aesd_seekseq)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 3
 
 #endif /* AESD_IOCTL_H */
@@ -10,8 +10,11 @@
 
 #include "aesd-circular-buffer.h"
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include "aesd-spsc.h"
+#include "aesd-stats.h"
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+/* AESD_DEBUG comes from the Makefile, build with DEBUG=y to enable PDEBUG */
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -31,12 +34,33 @@ struct aesd_dev
     /**
      * TODO: Add structure(s) and locks needed to complete assignment requirements
      */
-     char write_buff[1024];
-     int write_len;
-     struct mutex write_mutex;
+     char *write_buff;     /* partial record of a file closed before its newline */
+     size_t write_len;
+     size_t write_cap;
+     struct mutex write_mutex; /* protects write_buff, adopted by the next write to any file */
+     atomic64_t pending_bytes; /* staged in all files and write_buff, not yet committed */
+     struct rw_semaphore ring_lock; /* readers share dev_buff, commits take it exclusively */
+     struct aesd_spsc spsc; /* bypasses ring_lock with one writer and one reader attached */
      struct aesd_circular_buffer* dev_buff;
+     struct aesd_persist* persist; /* NULL unless persist_path is set */
+     struct aesd_stats stats;
+     struct dentry* debugfs;
      struct cdev cdev;     /* Char device structure      */
 };
 
+/**
+ * Write staging of one open file. Writers through different files only meet
+ * on ring_lock, for as long as it takes to link a complete record in.
+ */
+struct aesd_file
+{
+     struct aesd_dev *dev;
+     struct mutex lock;    /* serializes writes through this file */
+     char *write_buff;     /* bytes written since the last newline */
+     size_t write_len;
+     size_t write_cap;
+     void *zwork;          /* LZ4 scratch memory, allocated on the first compressed record */
+};
+
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
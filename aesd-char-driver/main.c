@@ -16,14 +16,20 @@
 #include <linux/mutex.h>
 #include <linux/string.h>
 #include <linux/init.h>
+#include <linux/kernel.h> // swap
 #include <linux/printk.h>
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h> // kmalloc
+#include <linux/uio.h> // iov_iter
+#include <linux/uaccess.h> // copy_to_user
 #include "aesd-circular-buffer.h"
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
+#include "aesd-compress.h"
+#include "aesd-persist.h"
+#include "aesd-stats.h"
 
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
@@ -31,101 +37,323 @@ int aesd_minor =   0;
 MODULE_AUTHOR("Eric Boccati"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
+static unsigned long max_bytes;
+module_param(max_bytes, ulong, 0444);
+MODULE_PARM_DESC(max_bytes, "Evict the oldest records once they hold more bytes than this, 0 for no limit");
+
+static unsigned int max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(max_entries, uint, 0444);
+MODULE_PARM_DESC(max_entries, "Most records kept, capped to AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED");
+
 struct aesd_dev aesd_device;
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file;
     PDEBUG("open");
-    /**
-     * TODO: handle open
-     */
 
-    struct aesd_dev* dev_data = container_of(inode->i_cdev, struct aesd_dev, cdev);
-    filp->private_data = dev_data;
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file){
+        return -ENOMEM;
+    }
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    mutex_init(&file->lock);
+    filp->private_data = file;
+    aesd_spsc_open(file->dev, filp->f_mode);
 
     return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    char *grown;
     PDEBUG("release");
-    /**
-     * TODO: handle release
-     */
+
+    // hand an unterminated record over to the next writer, as if all files shared one buffer
+    if (file->write_len){
+        mutex_lock(&dev->write_mutex);
+        if (dev->write_len == 0){
+            swap(dev->write_buff, file->write_buff);
+            swap(dev->write_cap, file->write_cap);
+            swap(dev->write_len, file->write_len);
+        } else {
+            grown = krealloc(dev->write_buff, dev->write_len + file->write_len, GFP_KERNEL);
+            if (grown){
+                memcpy(grown + dev->write_len, file->write_buff, file->write_len);
+                dev->write_buff = grown;
+                dev->write_len += file->write_len;
+                dev->write_cap = dev->write_len;
+            } else {
+                atomic64_sub(file->write_len, &dev->pending_bytes);
+            }
+        }
+        mutex_unlock(&dev->write_mutex);
+    }
+    aesd_spsc_release(dev, filp->f_mode);
+    kfree(file->write_buff);
+    aesd_compress_free_workmem(file->zwork);
+    mutex_destroy(&file->lock);
+    kfree(file);
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-    ssize_t bytes_read;
-    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
-    /**
-    * TODO: handle read
-    */
-    size_t read_offs = (size_t) filp->f_pos;
-    size_t ret_offs;
-    PDEBUG("read offset %lld bytes",read_offs);
-    PDEBUG("we have buffer at %p", aesd_device.dev_buff);
-    struct aesd_buffer_entry* entry = aesd_circular_buffer_find_entry_offset_for_fpos(aesd_device.dev_buff, read_offs, &ret_offs);
-    PDEBUG("ret offset %lld bytes",ret_offs);
-    if ( entry == 0 ){
-        PDEBUG("got empty entry");
-        return 0;
+    loff_t pos = iocb->ki_pos;
+    size_t entry_offs = pos, chunk, copied, entries = 0;
+    ssize_t bytes_read = 0;
+    int err = 0;
+    unsigned int i, count;
+    const struct aesd_circular_buffer *buffer;
+    struct aesd_buffer_entry* entry;
+    struct aesd_zblock *block;
+    struct aesd_ring_view view;
+    const char *data;
+    PDEBUG("read %zu bytes with offset %lld", iov_iter_count(to), pos);
+
+    // locked reads only share the ring lock, so any number of preads on one fd can run at once,
+    // lock-free ones take turns on the spsc reader lock
+    aesd_ring_read_begin(&aesd_device, &view);
+    buffer = view.buffer;
+    count = aesd_circular_buffer_count(buffer);
+    // walk the ring once: skip to the entry holding pos, then fill every segment of the iov
+    // from the entries that follow it before giving the lock back
+    for (i = 0; i < count; i++) {
+        entry = buffer->entry[(buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+        if (entry_offs < entry->size){
+            break;
+        }
+        entry_offs -= entry->size;
     }
-    PDEBUG("got entry %s with size %d",entry->buffptr, entry->size);
-    bytes_read = min(count, entry->size - ret_offs);
-    PDEBUG("Bytes to read %d in entry len %d from offset %d", bytes_read, entry->size,ret_offs);
-    copy_to_user(buf, entry->buffptr + ret_offs, bytes_read);
-    *f_pos += bytes_read; 
-
+    for (; i < count && iov_iter_count(to) > 0; i++, entry_offs = 0) {
+        entry = buffer->entry[(buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+        chunk = min(iov_iter_count(to), entry->size - entry_offs);
+        block = NULL;
+        data = entry->buffptr;
+        if (entry->zsize){
+            block = aesd_decompress_get(entry, &aesd_device.stats);
+            if (!block){
+                err = -EIO;
+                break;
+            }
+            data = block->data;
+        }
+        copied = copy_to_iter(data + entry_offs, chunk, to);
+        if (block){
+            aesd_decompress_put(block);
+        }
+        entries++;
+        pos += copied;
+        bytes_read += copied;
+        if (copied != chunk){
+            err = -EFAULT;
+            break;
+        }
+    }
+    // the entry may be freed as soon as the view is dropped, err is decided before
+    aesd_ring_read_end(&aesd_device, &view);
+
+    atomic64_inc(&aesd_device.stats.reads);
+    atomic64_add(bytes_read, &aesd_device.stats.read_bytes);
+    atomic64_add(entries, &aesd_device.stats.read_entries);
+    if (bytes_read == 0 && err){
+        return err;
+    }
+    iocb->ki_pos = pos;
     return bytes_read;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+/**
+ * Take ring_lock for a commit, accounting the time spent waiting for it.
+ * @return the time the lock was acquired, to be passed to aesd_ring_unlock()
+ */
+static ktime_t aesd_ring_lock(void)
+{
+    ktime_t start = ktime_get(), locked;
+    down_write(&aesd_device.ring_lock);
+    locked = ktime_get();
+    aesd_stat_time_add(&aesd_device.stats.lock_wait, start, locked);
+    return locked;
+}
+
+static void aesd_ring_unlock(ktime_t locked)
 {
-    ssize_t retval = -ENOMEM;
-    PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
-    /**
-     * TODO: handle write
-     */
+    aesd_stat_time_add(&aesd_device.stats.lock_hold, locked, ktime_get());
+    up_write(&aesd_device.ring_lock);
+}
 
-    mutex_lock(&aesd_device.write_mutex);
-    retval = copy_from_user(&aesd_device.write_buff[aesd_device.write_len], buf, count);
-    if (retval != 0){
-        mutex_unlock(&aesd_device.write_mutex);
-        return -EFAULT;
+static void aesd_free_evicted(struct aesd_buffer_entry **evicted, size_t nevicted)
+{
+    size_t i;
+    for (i = 0; i < nevicted; i++){
+        PDEBUG("free entry memory of size %zu", evicted[i]->size);
+        kfree(evicted[i]->buffptr);
+        kfree(evicted[i]);
     }
-    aesd_device.write_len = aesd_device.write_len + count;
-    PDEBUG("write buffer cointains: %s", aesd_device.write_buff);
+}
 
-    if ( strcmp(&aesd_device.write_buff[aesd_device.write_len -1], "\n") == 0){
-        PDEBUG("newline detected");
+/**
+ * Store @param len bytes of @param data as a new record written through @param file. The record
+ * is copied, compressed when enabled, and its persisted copy allocated before ring_lock is taken,
+ * so the lock only covers linking it in and queueing that copy. Entries evicted to make room are appended to @param evicted, which must have
+ * room for AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED more.
+ */
+static int aesd_commit_record(struct aesd_file *file, const char *data, size_t len,
+        struct aesd_buffer_entry **evicted, size_t *nevicted)
+{
+    struct aesd_buffer_entry *new_entry;
+    struct aesd_persist_record *rec;
+    ktime_t start = ktime_get(), locked;
+    size_t n, zsize = 0;
+    char *buffptr;
+
+    new_entry = kmalloc(sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+    if (!new_entry){
+        return -ENOMEM;
+    }
+    buffptr = aesd_compress(data, len, &zsize, &file->zwork, &aesd_device.stats);
+    if (!buffptr){
+        buffptr = kmalloc(len, GFP_KERNEL);
+        if (!buffptr){
+            kfree(new_entry);
+            return -ENOMEM;
+        }
+        memcpy(buffptr, data, len);
+    }
+    new_entry->buffptr = buffptr;
+    new_entry->size = len;
+    new_entry->zsize = zsize;
+    rec = aesd_persist_prepare(aesd_device.persist, data, len);
+
+    while (!aesd_spsc_commit(&aesd_device, new_entry, rec, evicted, nevicted)){
+        locked = aesd_ring_lock();
+        // the lock-free mode only changes under ring_lock, it may have been switched on since the check
+        if (!READ_ONCE(aesd_device.spsc.enabled)){
+            new_entry->timestamp_ns = ktime_get_real_ns();
+            n = aesd_circular_buffer_add_entry_evict(aesd_device.dev_buff, new_entry, evicted + *nevicted);
+            aesd_persist_commit(aesd_device.persist, rec, new_entry);
+            aesd_ring_unlock(locked);
+            aesd_stats_evicted(&aesd_device.stats, evicted + *nevicted, n);
+            *nevicted += n;
+            break;
+        }
+        aesd_ring_unlock(locked);
+    }
+    atomic64_sub(len, &aesd_device.pending_bytes);
 
-        struct aesd_buffer_entry *new_entry = (struct aesd_buffer_entry*) kmalloc(sizeof(struct aesd_buffer_entry), GFP_KERNEL);
-        new_entry->size = aesd_device.write_len;
-        new_entry->buffptr = (char *) kmalloc(sizeof(char) * aesd_device.write_len, GFP_KERNEL);
-        memcpy(new_entry->buffptr, aesd_device.write_buff, sizeof(char) * aesd_device.write_len);
-        PDEBUG("write buffer cointains: %s", aesd_device.write_buff);
+    aesd_stat_time_add(&aesd_device.stats.commit, start, ktime_get());
+    return 0;
+}
 
-        struct aesd_buffer_entry* old_entry = aesd_circular_buffer_add_entry(aesd_device.dev_buff, new_entry);
-        if ( old_entry != NULL ){
-            PDEBUG("free entry memory containing %s size %d", old_entry->buffptr, old_entry->size);
-            kfree(old_entry->buffptr);
-            kfree(old_entry);
+/**
+ * Take over the partial record left by a file closed mid-record, so it is completed by the
+ * next write through any file. @param file holds no partial record of its own.
+ */
+static void aesd_adopt_partial(struct aesd_file *file)
+{
+    struct aesd_dev *dev = file->dev;
+
+    mutex_lock(&dev->write_mutex);
+    swap(dev->write_buff, file->write_buff);
+    swap(dev->write_cap, file->write_cap);
+    swap(dev->write_len, file->write_len);
+    mutex_unlock(&dev->write_mutex);
+}
+
+/**
+ * Record ordering: records written through one file are committed in the order they were
+ * written. Records of different files are ordered by when their newline was written, and a
+ * record never mixes bytes of two files except for a partial record handed over on release,
+ * which prefixes the next record written through any file.
+ */
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    size_t count = iov_iter_count(from);
+    struct aesd_buffer_entry *evicted[2 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    size_t nevicted = 0, copied, pending, start, scan, len;
+    char *newline, *grown;
+    ssize_t retval = 0;
+    PDEBUG("write %zu bytes with offset %lld", count, iocb->ki_pos);
+
+    if (count == 0){
+        return 0;
+    }
+
+    mutex_lock(&file->lock);
+    if (file->write_len == 0 && READ_ONCE(file->dev->write_len)){
+        aesd_adopt_partial(file);
+    }
+    if (file->write_len + count > file->write_cap){
+        grown = krealloc(file->write_buff, file->write_len + count, GFP_KERNEL);
+        if (!grown){
+            mutex_unlock(&file->lock);
+            return -ENOMEM;
+        }
+        file->write_buff = grown;
+        file->write_cap = file->write_len + count;
+    }
+    // gather every segment behind the pending partial record
+    copied = copy_from_iter(file->write_buff + file->write_len, count, from);
+    if (copied == 0){
+        mutex_unlock(&file->lock);
+        return -EFAULT;
+    }
+    pending = file->write_len;
+    file->write_len += copied;
+    atomic64_add(copied, &aesd_device.pending_bytes);
+
+    // one record per newline, whichever segment it arrived in
+    start = 0;
+    scan = pending;
+    while (scan < file->write_len &&
+            (newline = memchr(file->write_buff + scan, '\n', file->write_len - scan)) != NULL){
+        len = newline + 1 - file->write_buff - start;
+        if (nevicted > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED){
+            aesd_free_evicted(evicted, nevicted);
+            nevicted = 0;
+        }
+        retval = aesd_commit_record(file, file->write_buff + start, len, evicted, &nevicted);
+        if (retval){
+            break;
+        }
+        start += len;
+        scan = start;
+    }
+    if (retval){
+        // only report the bytes that made it into a record, drop the rest of this call
+        atomic64_sub(file->write_len - max(start, pending), &aesd_device.pending_bytes);
+        if (start > pending){
+            copied = start - pending;
+            file->write_len = start;
+        } else {
+            copied = 0;
+            file->write_len = pending;
         }
+    }
+    if (start > 0){
+        memmove(file->write_buff, file->write_buff + start, file->write_len - start);
+        file->write_len -= start;
+    }
+    mutex_unlock(&file->lock);
+    // one large record may displace many small ones, free them outside the lock
+    aesd_free_evicted(evicted, nevicted);
 
-        memset(aesd_device.write_buff, 0, sizeof(aesd_device.write_buff));
-        aesd_device.write_len = 0;
+    // records are appended to the ring, the write leaves the read position alone
+    if (copied == 0){
+        return retval;
     }
-    mutex_unlock(&aesd_device.write_mutex);
-    retval = count;
-    return retval;
+    return copied;
 }
 
 loff_t aesd_llseek(struct file *filp, loff_t off, int whence){
-    loff_t newpos;
+    loff_t newpos, size;
+    struct aesd_ring_view view;
+    aesd_ring_read_begin(&aesd_device, &view);
+    size = view.buffer->size;
+    aesd_ring_read_end(&aesd_device, &view);
     switch (whence) {
         case 0: /* SEEK_SET*/
             newpos = off;
@@ -134,7 +362,7 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence){
             newpos = filp->f_pos + off;
             break;
         case 2: /* SEEK_END*/
-            newpos = aesd_device.dev_buff->size + off;
+            newpos = size + off;
             break;
         default: /* can't happen */
             return -EINVAL;
@@ -142,37 +370,87 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence){
     if(newpos < 0){
         return -EINVAL;
     }
-    if(newpos > aesd_device.dev_buff->size){
+    if(newpos > size){
         return -EINVAL;
     }
     filp->f_pos = newpos;
     return newpos;
 }
 
+static long aesd_resolve_offset(uint32_t write_cmd, uint32_t write_cmd_offset){
+    long offset;
+    struct aesd_ring_view view;
+    aesd_ring_read_begin(&aesd_device, &view);
+    offset = aesd_circular_buffer_offset_adjust((struct aesd_circular_buffer *) view.buffer, write_cmd, write_cmd_offset);
+    aesd_ring_read_end(&aesd_device, &view);
+    return offset;
+}
+
 long aesd_ioctl(struct file *filp,unsigned int cmd, unsigned long arg){
     struct aesd_seekto pargs;
+    struct aesd_offset_query query;
+    struct aesd_seekseq seekseq;
+    struct aesd_ring_view view;
     long newpos;
-    int ret = copy_from_user(&pargs,(const void __user *)arg, sizeof(pargs));
+
+    if (_IOC_TYPE(cmd) != AESD_IOC_MAGIC || _IOC_NR(cmd) > AESDCHAR_IOC_MAXNR){
+        return -ENOTTY;
+    }
     switch (cmd) {
         case AESDCHAR_IOCSEEKTO:
-            newpos = aesd_circular_buffer_offset_adjust(aesd_device.dev_buff, pargs.write_cmd, pargs.write_cmd_offset);
-            if(newpos >= 0){
-                printk("setting ioctl offset to %d", newpos);
-                filp->f_pos = newpos;
-            }else {
+            if (copy_from_user(&pargs, (const void __user *)arg, sizeof(pargs))){
+                return -EFAULT;
+            }
+            newpos = aesd_resolve_offset(pargs.write_cmd, pargs.write_cmd_offset);
+            if(newpos < 0){
+                return -EINVAL;
+            }
+            PDEBUG("setting ioctl offset to %ld", newpos);
+            filp->f_pos = newpos;
+            break;
+        case AESDCHAR_IOCQUERYOFFS:
+            if (copy_from_user(&query, (const void __user *)arg, sizeof(query))){
+                return -EFAULT;
+            }
+            newpos = aesd_resolve_offset(query.write_cmd, query.write_cmd_offset);
+            if(newpos < 0){
                 return -EINVAL;
             }
+            query.offset = newpos;
+            if (copy_to_user((void __user *)arg, &query, sizeof(query))){
+                return -EFAULT;
+            }
+            break;
+        case AESDCHAR_IOCSEEKSEQ:
+            if (copy_from_user(&seekseq, (const void __user *)arg, sizeof(seekseq))){
+                return -EFAULT;
+            }
+            aesd_ring_read_begin(&aesd_device, &view);
+            newpos = aesd_circular_buffer_seq_offset((struct aesd_circular_buffer *) view.buffer, seekseq.seq);
+            seekseq.next_seq = view.buffer->entries_added;
+            seekseq.oldest_seq = aesd_circular_buffer_oldest_seq(view.buffer);
+            aesd_ring_read_end(&aesd_device, &view);
+            seekseq.offset = newpos >= 0 ? newpos : 0;
+            // the bounds are returned on ERANGE too, so the caller knows where to resume
+            if (copy_to_user((void __user *)arg, &seekseq, sizeof(seekseq))){
+                return -EFAULT;
+            }
+            if (newpos < 0){
+                return newpos;
+            }
+            PDEBUG("seeking to seq %llu at offset %ld", seekseq.seq, newpos);
+            filp->f_pos = newpos;
             break;
         default:
-            return -EINVAL;
+            return -ENOTTY;
     }
     return 0;
 }
 
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
-    .read =     aesd_read,
-    .write =    aesd_write,
+    .read_iter = aesd_read_iter,
+    .write_iter = aesd_write_iter,
     .open =     aesd_open,
     .release =  aesd_release,
     .llseek =   aesd_llseek,
@@ -195,6 +473,18 @@ static int aesd_setup_cdev(struct aesd_dev *dev)
 
 
 
+static void aesd_free_entries(void)
+{
+    uint8_t index = 0;
+    struct aesd_buffer_entry *entry;
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, aesd_device.dev_buff, index) {
+        if (entry) {
+            kfree(entry->buffptr);
+            kfree(entry);
+        }
+    }
+}
+
 int aesd_init_module(void)
 {
     dev_t dev = 0;
@@ -207,15 +497,37 @@ int aesd_init_module(void)
     }
     memset(&aesd_device,0,sizeof(struct aesd_dev));
     aesd_device.dev_buff = (struct aesd_circular_buffer *) kmalloc(sizeof(struct aesd_circular_buffer),GFP_KERNEL);
+    if (!aesd_device.dev_buff) {
+        unregister_chrdev_region(dev, 1);
+        return -ENOMEM;
+    }
     aesd_circular_buffer_init(aesd_device.dev_buff);
+    aesd_device.dev_buff->max_bytes = max_bytes;
+    aesd_device.dev_buff->max_entries = max_entries;
     mutex_init(&aesd_device.write_mutex);
+    init_rwsem(&aesd_device.ring_lock);
+    aesd_spsc_init(&aesd_device);
     /**
      * TODO: initialize the AESD specific portion of the device
      */
 
+    // reload persisted records before anyone can open the device
+    result = aesd_persist_init(&aesd_device);
+    if( result ) {
+        aesd_free_entries();
+        kfree(aesd_device.dev_buff);
+        unregister_chrdev_region(dev, 1);
+        return result;
+    }
+
+    aesd_stats_init(&aesd_device);
     result = aesd_setup_cdev(&aesd_device);
 
     if( result ) {
+        aesd_stats_exit(&aesd_device);
+        aesd_persist_exit(&aesd_device);
+        aesd_free_entries();
+        kfree(aesd_device.dev_buff);
         unregister_chrdev_region(dev, 1);
     }
     return result;
@@ -231,12 +543,14 @@ void aesd_cleanup_module(void)
     /**
      * TODO: cleanup AESD specific poritions here as necessary
      */
-    // int index = 0;
-    // struct aesd_buffer_entry *entry;
-    // AESD_CIRCULAR_BUFFER_FOREACH(entry, aesd_device.dev_buff, index) {
-    //    kfree(entry->buffptr);
-    //    kfree(entry);
-    // }
+    aesd_stats_exit(&aesd_device);
+    // flush what is still queued for disk before the records go away
+    aesd_persist_exit(&aesd_device);
+    aesd_spsc_exit(&aesd_device);
+    aesd_free_entries();
+    aesd_compress_exit();
+    kfree(aesd_device.dev_buff);
+    kfree(aesd_device.write_buff);
     mutex_destroy(&aesd_device.write_mutex);
     unregister_chrdev_region(devno, 1);
 }
@@ -1,12 +1,21 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+extern char **environ;
+
 /**
  * @param cmd the command to execute with system()
  * @return true if the command in @param cmd was executed
@@ -30,6 +39,91 @@ bool do_system(const char *cmd)
     return true;
 }
 
+/**
+ * posix_spawn() @param argv with @param actions, resetting signal mask and dispositions.
+ */
+static int spawn_with_actions(char * const argv[], const posix_spawn_file_actions_t *actions, pid_t *pid)
+{
+    posix_spawnattr_t attr;
+    sigset_t signals;
+    int ret;
+
+    ret = posix_spawnattr_init(&attr);
+    if (ret != 0){
+        return ret;
+    }
+
+    // the caller may block or ignore signals, e.g. for a signalfd, the command must not inherit that
+    sigemptyset(&signals);
+    ret = posix_spawnattr_setsigmask(&attr, &signals);
+    sigfillset(&signals);
+    sigdelset(&signals, SIGKILL);
+    sigdelset(&signals, SIGSTOP);
+    if (ret == 0){
+        ret = posix_spawnattr_setsigdefault(&attr, &signals);
+    }
+    if (ret == 0){
+        ret = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    }
+
+    // glibc spawns with clone(CLONE_VM | CLONE_VFORK), and reports exec failures here
+    if (ret == 0){
+        ret = posix_spawn(pid, argv[0], actions, &attr, argv, environ);
+    }
+
+    posix_spawnattr_destroy(&attr);
+    return ret;
+}
+
+int spawn_command(char * const argv[], const char *outputfile, pid_t *pid)
+{
+    posix_spawn_file_actions_t actions;
+    int ret;
+
+    ret = posix_spawn_file_actions_init(&actions);
+    if (ret != 0){
+        return ret;
+    }
+    if (outputfile != NULL){
+        ret = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, outputfile,
+                O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (ret == 0){
+        ret = spawn_with_actions(argv, &actions, pid);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    return ret;
+}
+
+static void reap_job(struct exec_job *job, pid_t pid)
+{
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0){
+        if (errno != EINTR){
+            job->status = -1;
+            return;
+        }
+    }
+    job->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * Spawn @param command, wait for it and report whether it exited with status 0.
+ */
+static bool wait_command(char * const command[], const char *outputfile)
+{
+    struct exec_job job = { .argv = command, .outputfile = outputfile };
+    pid_t pid;
+
+    fflush(stdout);
+    if (spawn_command(command, outputfile, &pid) != 0){
+        return false;
+    }
+    reap_job(&job, pid);
+    return job.status == 0;
+}
+
 /**
 * @param count -The numbers of variables passed to the function. The variables are command to execute.
 *   followed by arguments to pass to the command
@@ -39,8 +133,8 @@ bool do_system(const char *cmd)
 *   The first is always the full path to the command to execute with execv()
 *   The remaining arguments are a list of arguments to pass to the command in execv()
 * @return true if the command @param ... with arguments @param arguments were executed successfully
-*   using the execv() call, false if an error occurred, either in invocation of the
-*   fork, waitpid, or execv() command, or if a non-zero return value was returned
+*   using posix_spawn(), false if an error occurred, either in invocation of the
+*   posix_spawn() or waitpid() call, or if a non-zero return value was returned
 *   by the command issued in @param arguments with the specified arguments.
 */
 
@@ -53,47 +147,11 @@ bool do_exec(int count, ...)
     for(i=0; i<count; i++)
     {
         command[i] = va_arg(args, char *);
-        }
-    command[count] = NULL;
-    // this line is to avoid a compile warning before your implementation is complete
-    // and may be removed
-    // command[count] = command[count];
-
-/*
- * TODO:
- *   Execute a system command by calling fork, execv(),
- *   and wait instead of system (see LSP page 161).
- *   Use the command[0] as the full path to the command to execute
- *   (first argument to execv), and use the remaining arguments
- *   as second argument to the execv() command.
- *
-*/
-    int cpid = fork();
-    int status;
-    int cret = -1;
-    if(cpid == -1){
-        //fork failed
-        return false;
-    }
-    if (cpid == 0){
-        //child code
-        execv(command[0], &command[0]);
-
-    }else{
-        //parent code
-        waitpid(cpid, &status, 0);
-        if (WIFEXITED(status)){
-            cret = WEXITSTATUS(status);    
-        }
     }
-
+    command[count] = NULL;
     va_end(args);
 
-    if (cret == -1){
-        return false;
-    }else{
-        return true;
-    }
+    return wait_command(command, NULL);
 }
 
 /**
@@ -110,33 +168,333 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
     for(i=0; i<count; i++)
     {
         command[i] = va_arg(args, char *);
-        }
+    }
     command[count] = NULL;
-    // this line is to avoid a compile warning before your implementation is complete
-    // and may be removed
-    // command[count] = command[count];
-    // char redirection[strlen(outputfile)];
-    // sprintf(redirection, ">%s", outputfile);
-    // command[count] = redirection;
+    va_end(args);
 
-/*
- * TODO
- *   Call execv, but first using https://stackoverflow.com/a/13784315/1446624 as a refernce,
- *   redirect standard out to a file specified by outputfile.
- *   The rest of the behaviour is same as do_exec()
- *
-*/
-    printf("cmd 0: %s\n", command[0]);
-    printf("cmd 1: %s\n", command[1]);
-    printf("cmd 2: %s\n", command[2]);
-    printf("cmd 3: %s\n", command[3]);
-    int ret = execv(command[0], &command[0]);
+    return wait_command(command, outputfile);
+}
 
-    va_end(args);
+/**
+ * @return a pidfd for @param pid, or -1 when the kernel has none and jobs are reaped in order
+ */
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void) pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
 
-    if (ret < 0){
+size_t do_exec_batch(struct exec_job *jobs, size_t count, size_t parallel)
+{
+    struct running
+    {
+        size_t job;
+        pid_t pid;
+    } *running;
+    struct pollfd *fds;
+    size_t next = 0, nrunning = 0, ok = 0, i;
+    bool pidfds = true;
+
+    if (parallel == 0){
+        parallel = 1;
+    }
+    running = calloc(parallel, sizeof(*running));
+    fds = calloc(parallel, sizeof(*fds));
+    if (running == NULL || fds == NULL){
+        free(running);
+        free(fds);
+        for (i = 0; i < count; i++){
+            jobs[i].status = -1;
+        }
+        return 0;
+    }
+
+    while (next < count || nrunning > 0){
+        // keep the batch full
+        while (next < count && nrunning < parallel){
+            struct exec_job *job = &jobs[next++];
+            pid_t pid;
+            if (spawn_command(job->argv, job->outputfile, &pid) != 0){
+                job->status = -1;
+                continue;
+            }
+            running[nrunning].job = job - jobs;
+            running[nrunning].pid = pid;
+            fds[nrunning].fd = pidfds ? open_pidfd(pid) : -1;
+            fds[nrunning].events = POLLIN;
+            fds[nrunning].revents = 0;
+            if (fds[nrunning].fd < 0){
+                pidfds = false;
+            }
+            nrunning++;
+        }
+        if (nrunning == 0){
+            break;
+        }
+
+        if (pidfds){
+            // a pidfd turns readable once its process has exited
+            if (poll(fds, nrunning, -1) < 0){
+                if (errno == EINTR){
+                    continue;
+                }
+                pidfds = false;
+            }
+        }
+        for (i = 0; i < nrunning; ){
+            if (pidfds && !(fds[i].revents & (POLLIN | POLLHUP))){
+                i++;
+                continue;
+            }
+            reap_job(&jobs[running[i].job], running[i].pid);
+            if (fds[i].fd >= 0){
+                close(fds[i].fd);
+            }
+            running[i] = running[nrunning - 1];
+            fds[i] = fds[nrunning - 1];
+            nrunning--;
+            if (!pidfds){
+                break;  // without pidfds, wait for one job at a time
+            }
+        }
+    }
+
+    for (i = 0; i < count; i++){
+        if (jobs[i].status == 0){
+            ok++;
+        }
+    }
+    free(running);
+    free(fds);
+    return ok;
+}
+
+#define CAPTURE_CHUNK 65536
+
+/**
+ * One captured stream of do_exec_capture()
+ */
+struct capture_stream
+{
+    int stream;
+    int pipe_fd;                // read end, -1 once closed
+    int file_fd;                // -1 when no file was asked for
+    bool splice;                // straight from the pipe to file_fd
+    struct exec_output *buffer;
+};
+
+static bool output_reserve(struct exec_output *out, size_t room)
+{
+    char *grown;
+    size_t cap = out->cap ? out->cap : CAPTURE_CHUNK;
+
+    if (out->cap - out->len > room){
+        return true;
+    }
+    while (cap - out->len <= room){
+        cap *= 2;
+    }
+    grown = realloc(out->data, cap);
+    if (grown == NULL){
         return false;
-    }else{
+    }
+    out->data = grown;
+    out->cap = cap;
+    return true;
+}
+
+static bool write_all(int fd, const char *data, size_t len)
+{
+    ssize_t ret;
+
+    while (len > 0){
+        ret = write(fd, data, len);
+        if (ret < 0 && errno == EINTR){
+            continue;
+        }
+        if (ret <= 0){
+            return false;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+/**
+ * Move what the pipe of @param s holds to its destinations.
+ * @return false once the stream is over, on EOF, error or when the callback asks to stop
+ */
+static bool capture_ready(struct capture_stream *s, const struct exec_capture *capture, bool *failed)
+{
+    char local[CAPTURE_CHUNK];
+    char *dst = local;
+    ssize_t n;
+
+    if (s->splice){
+        n = splice(s->pipe_fd, NULL, s->file_fd, NULL, CAPTURE_CHUNK, SPLICE_F_MOVE);
+        if (n >= 0 || errno == EINTR || errno == EAGAIN){
+            return n != 0;
+        }
+        if (errno != EINVAL){
+            *failed = true;
+            return false;
+        }
+        // the file cannot be spliced into, go through user space from now on
+        s->splice = false;
+    }
+
+    if (s->buffer != NULL){
+        if (!output_reserve(s->buffer, CAPTURE_CHUNK)){
+            *failed = true;
+            return false;
+        }
+        dst = s->buffer->data + s->buffer->len;
+    }
+    n = read(s->pipe_fd, dst, CAPTURE_CHUNK);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)){
         return true;
     }
+    if (n <= 0){
+        *failed |= n < 0;
+        return false;
+    }
+    if (s->buffer != NULL){
+        s->buffer->len += n;
+        s->buffer->data[s->buffer->len] = '\0';
+    }
+    if (s->file_fd >= 0 && !write_all(s->file_fd, dst, n)){
+        *failed = true;
+        return false;
+    }
+    if (capture->callback != NULL && !capture->callback(s->stream, dst, n, capture->ctx)){
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Prepare @param stream of the child, @param write_end receives the end of the pipe to close
+ * in the parent once the child is started.
+ * @return 0 on success, an errno value otherwise
+ */
+static int capture_setup(struct capture_stream *s, int stream, struct exec_output *buffer,
+        const char *file, const struct exec_capture *capture, posix_spawn_file_actions_t *actions,
+        int *write_end)
+{
+    int fds[2];
+
+    s->stream = stream;
+    s->pipe_fd = -1;
+    s->file_fd = -1;
+    s->buffer = buffer;
+    s->splice = false;
+    if (buffer == NULL && file == NULL && capture->callback == NULL){
+        return 0;
+    }
+    if (file != NULL){
+        s->file_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (s->file_fd < 0){
+            return errno;
+        }
+        s->splice = buffer == NULL && capture->callback == NULL;
+    }
+    if (buffer != NULL && !output_reserve(buffer, 0)){
+        return ENOMEM;
+    }
+    if (buffer != NULL){
+        buffer->data[buffer->len] = '\0';
+    }
+    if (pipe2(fds, O_CLOEXEC) != 0){
+        return errno;
+    }
+    s->pipe_fd = fds[0];
+    *write_end = fds[1];
+    // the dup2 copy in the child loses O_CLOEXEC, both originals go away on exec
+    return posix_spawn_file_actions_adddup2(actions, fds[1], stream);
+}
+
+int do_exec_capture(char * const argv[], struct exec_capture *capture)
+{
+    struct capture_stream streams[2];
+    struct pollfd fds[2];
+    struct exec_job job = { .argv = argv };
+    posix_spawn_file_actions_t actions;
+    int write_ends[2] = { -1, -1 };
+    bool failed = false;
+    pid_t pid;
+    int ret, i, nfds;
+
+    if (posix_spawn_file_actions_init(&actions) != 0){
+        return -1;
+    }
+    ret = capture_setup(&streams[0], STDOUT_FILENO, capture->out, capture->outputfile, capture, &actions,
+            &write_ends[0]);
+    if (ret == 0){
+        ret = capture_setup(&streams[1], STDERR_FILENO, capture->err, capture->errorfile, capture, &actions,
+                &write_ends[1]);
+    } else {
+        streams[1].pipe_fd = streams[1].file_fd = -1;
+    }
+    if (ret == 0){
+        fflush(stdout);
+        ret = spawn_with_actions(argv, &actions, &pid);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    // only the child may hold the write ends, or EOF never comes
+    for (i = 0; i < 2; i++){
+        if (write_ends[i] >= 0){
+            close(write_ends[i]);
+        }
+    }
+
+    while (ret == 0){
+        nfds = 0;
+        for (i = 0; i < 2; i++){
+            if (streams[i].pipe_fd >= 0){
+                fds[nfds].fd = streams[i].pipe_fd;
+                fds[nfds].events = POLLIN;
+                nfds++;
+            }
+        }
+        if (nfds == 0){
+            break;
+        }
+        if (poll(fds, nfds, -1) < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            failed = true;
+            break;
+        }
+        for (i = 0, nfds = 0; i < 2; i++){
+            if (streams[i].pipe_fd < 0){
+                continue;
+            }
+            if ((fds[nfds++].revents & (POLLIN | POLLHUP | POLLERR)) &&
+                    !capture_ready(&streams[i], capture, &failed)){
+                close(streams[i].pipe_fd);
+                streams[i].pipe_fd = -1;
+            }
+        }
+    }
+
+    for (i = 0; i < 2; i++){
+        if (streams[i].pipe_fd >= 0){
+            close(streams[i].pipe_fd);
+        }
+        if (streams[i].file_fd >= 0){
+            close(streams[i].file_fd);
+        }
+    }
+    if (ret != 0){
+        return -1;
+    }
+    reap_job(&job, pid);
+    return failed ? -1 : job.status;
 }
@@ -1,9 +1,75 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <sys/types.h>
 
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+ * Start @param argv, argv[0] being the full path of the command, with posix_spawn(), so the
+ * caller's page tables are never copied.
+ * @param outputfile when not NULL, stdout of the command is truncated to this file
+ * @param pid receives the pid of the child, to be reaped with waitpid()
+ * @return 0 on success, an errno value otherwise
+ */
+int spawn_command(char * const argv[], const char *outputfile, pid_t *pid);
+
+/**
+ * One command of a batch
+ */
+struct exec_job
+{
+    char * const *argv;         // NULL terminated, argv[0] the full path of the command
+    const char *outputfile;     // stdout is redirected here when not NULL
+    int status;                 // set by do_exec_batch(): the exit status, or -1 if the command
+                                // could not start or was killed by a signal
+};
+
+/**
+ * Run @param count @param jobs with at most @param parallel of them at once,
+ * collecting the exit status of each.
+ * @return the number of jobs which exited with status 0
+ */
+size_t do_exec_batch(struct exec_job *jobs, size_t count, size_t parallel);
+
+/**
+ * Growable buffer receiving the output of a command, NUL terminated, freed by the caller
+ */
+struct exec_output
+{
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/**
+ * Receives output as it arrives, @param stream being STDOUT_FILENO or STDERR_FILENO.
+ * @return false to stop reading that stream, the command then gets SIGPIPE if it keeps writing
+ */
+typedef bool (*exec_output_cb)(int stream, const char *data, size_t len, void *ctx);
+
+/**
+ * Where do_exec_capture() sends each stream, the callback getting both. A stream with nothing
+ * set is inherited. A stream with only a file is spliced into it without passing through user space.
+ */
+struct exec_capture
+{
+    struct exec_output *out;
+    struct exec_output *err;
+    exec_output_cb callback;
+    void *ctx;
+    const char *outputfile;     // truncated, then receives stdout
+    const char *errorfile;      // truncated, then receives stderr
+};
+
+/**
+ * Run @param argv, argv[0] being the full path of the command, reading its stdout and stderr
+ * through pipes as set in @param capture until both are closed.
+ * @return the exit status of the command, or -1 if it could not start, was killed by a signal
+ * or its output could not be stored
+ */
+int do_exec_capture(char * const argv[], struct exec_capture *capture);
@@ -0,0 +1,205 @@
+/**
+ * @file threading-bench.c
+ * @brief Task throughput of start_thread_obtaining_mutex() against the thread pool
+ *
+ * Usage: threading-bench [tasks] [pool threads]
+ *        threading-bench -j [tasks] [max wait ms] [wheel threads] [tick us]
+ * Tasks are started in batches, then joined, with zero waits so only the cost of starting,
+ * running and joining a task is measured. Built with make LOCKPROF=1, the contention on the
+ * shared mutex is written to stderr at exit.
+ * With -j every task waits 1 to max wait ms to obtain its own mutex and as long to release it,
+ * on a thread each and then on a timer wheel, and how late the wake ups came is printed.
+ */
+
+#include "threading.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#define BATCH 1000
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @return the number of tasks which completed successfully
+ */
+static long run_threads(pthread_mutex_t* mutex, long tasks)
+{
+    static pthread_t threads[BATCH];
+    long ok = 0;
+    long started;
+    void* data;
+
+    for (long done = 0; done < tasks; done += started){
+        for (started = 0; started < BATCH && done + started < tasks; started++){
+            if (!start_thread_obtaining_mutex(&threads[started], mutex, 0, 0)){
+                fprintf(stderr, "Cannot start thread\n");
+                break;
+            }
+        }
+        for (long i = 0; i < started; i++){
+            pthread_join(threads[i], &data);
+            ok += ((struct thread_data*) data)->thread_complete_success;
+            free(data);
+        }
+        if (started == 0){
+            break;
+        }
+    }
+    return ok;
+}
+
+static long run_pool(struct thread_pool* pool, pthread_mutex_t* mutex, long tasks)
+{
+    static struct thread_data* handles[BATCH];
+    long ok = 0;
+    long started;
+
+    for (long done = 0; done < tasks; done += started){
+        for (started = 0; started < BATCH && done + started < tasks; started++){
+            handles[started] = thread_pool_start(pool, mutex, 0, 0);
+            if (handles[started] == NULL){
+                fprintf(stderr, "Pool full\n");
+                break;
+            }
+        }
+        for (long i = 0; i < started; i++){
+            ok += thread_pool_join(pool, handles[i]);
+        }
+        if (started == 0){
+            break;
+        }
+    }
+    return ok;
+}
+
+static void print_jitter(const char* name, struct thread_data* const* data, size_t count)
+{
+    struct jitter_stats obtain;
+    struct jitter_stats release;
+
+    thread_jitter_stats(data, count, &obtain, &release);
+    printf("%s: %zu of %zu tasks completed, lateness in ms\n", name, obtain.count, count);
+    printf("    obtain  min %.3f mean %.3f p99 %.3f max %.3f\n", obtain.min_ns / 1e6,
+            obtain.mean_ns / 1e6, obtain.p99_ns / 1e6, obtain.max_ns / 1e6);
+    printf("    release min %.3f mean %.3f p99 %.3f max %.3f\n", release.min_ns / 1e6,
+            release.mean_ns / 1e6, release.p99_ns / 1e6, release.max_ns / 1e6);
+}
+
+/**
+ * Run the same timed tasks on a thread each, then on a timer wheel.
+ * Each task has its own mutex, so the figures are scheduling lateness and not contention.
+ */
+static int run_jitter(long tasks, int max_wait_ms, unsigned nthreads, unsigned tick_us)
+{
+    pthread_t* threads = calloc(tasks, sizeof(*threads));
+    pthread_mutex_t* mutexes = calloc(tasks, sizeof(*mutexes));
+    struct thread_data** data = calloc(tasks, sizeof(*data));
+    struct thread_data* slab = calloc(tasks, sizeof(*slab));
+    struct timer_wheel* wheel;
+    long started;
+    void* ret;
+
+    if (threads == NULL || mutexes == NULL || data == NULL || slab == NULL){
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    srand(1);
+    for (long i = 0; i < tasks; i++){
+        pthread_mutex_init(&mutexes[i], NULL);
+        slab[i].mutex = &mutexes[i];
+        slab[i].wait_to_obtain_ms = 1 + rand() % max_wait_ms;
+        slab[i].wait_to_release_ms = 1 + rand() % max_wait_ms;
+    }
+
+    for (started = 0; started < tasks; started++){
+        if (!start_thread_obtaining_mutex(&threads[started], &mutexes[started],
+                    slab[started].wait_to_obtain_ms, slab[started].wait_to_release_ms)){
+            fprintf(stderr, "Cannot start thread %ld\n", started);
+            break;
+        }
+    }
+    for (long i = 0; i < started; i++){
+        pthread_join(threads[i], &ret);
+        data[i] = ret;
+    }
+    print_jitter("thread per task", data, started);
+    for (long i = 0; i < started; i++){
+        free(data[i]);
+    }
+
+    wheel = timer_wheel_create(nthreads, tick_us);
+    if (wheel == NULL){
+        fprintf(stderr, "Cannot create timer wheel\n");
+        return 1;
+    }
+    for (started = 0; started < tasks; started++){
+        data[started] = &slab[started];
+        if (!timer_wheel_schedule(wheel, &slab[started])){
+            break;
+        }
+    }
+    timer_wheel_drain(wheel);
+    timer_wheel_destroy(wheel);
+    char name[64];
+    snprintf(name, sizeof(name), "timer wheel, %u threads, %u us tick", nthreads, tick_us);
+    print_jitter(name, data, started);
+
+    for (long i = 0; i < tasks; i++){
+        pthread_mutex_destroy(&mutexes[i]);
+    }
+    free(threads);
+    free(mutexes);
+    free(data);
+    free(slab);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && strcmp(argv[1], "-j") == 0){
+        long jitter_tasks = argc > 2 ? atol(argv[2]) : 2000;
+        int max_wait_ms = argc > 3 ? atoi(argv[3]) : 50;
+        unsigned wheel_threads = argc > 4 ? (unsigned) atoi(argv[4]) : 4;
+        unsigned tick_us = argc > 5 ? (unsigned) atoi(argv[5]) : 100;
+        if (jitter_tasks <= 0 || max_wait_ms <= 0){
+            fprintf(stderr, "Usage: %s -j [tasks] [max wait ms] [wheel threads] [tick us]\n", argv[0]);
+            return 1;
+        }
+        return run_jitter(jitter_tasks, max_wait_ms, wheel_threads, tick_us);
+    }
+
+    long tasks = argc > 1 ? atol(argv[1]) : 20000;
+    unsigned nthreads = argc > 2 ? (unsigned) atoi(argv[2]) : 4;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct thread_pool* pool;
+    double start, secs;
+    long ok;
+
+    // the lock profile goes to syslog, mirror it to stderr
+    openlog("threading-bench", LOG_PERROR, LOG_USER);
+
+    start = now_s();
+    ok = run_threads(&mutex, tasks);
+    secs = now_s() - start;
+    printf("thread per task: %ld of %ld tasks in %.3f s, %.0f tasks/s\n", ok, tasks, secs, ok / secs);
+
+    pool = thread_pool_create(nthreads, BATCH);
+    if (pool == NULL){
+        fprintf(stderr, "Cannot create pool\n");
+        return 1;
+    }
+    start = now_s();
+    ok = run_pool(pool, &mutex, tasks);
+    secs = now_s() - start;
+    printf("pool of %u: %ld of %ld tasks in %.3f s, %.0f tasks/s\n", nthreads, ok, tasks, secs, ok / secs);
+    thread_pool_destroy(pool);
+    return 0;
+}
@@ -1,49 +1,578 @@
 #include "threading.h"
+// make LOCKPROF=1 links in the lockprof.c of the server and profiles the callers' mutexes
+#include "lockprof.h"
+#include <errno.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 // Optional: use these functions to add debug or error prints to your application
 // #define DEBUG_LOG(msg,...)
 #define DEBUG_LOG(msg,...) printf("threading: " msg "\n" , ##__VA_ARGS__)
 #define ERROR_LOG(msg,...) printf("threading ERROR: " msg "\n" , ##__VA_ARGS__)
 
-void* threadfunc(void* thread_param)
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC 1000000000ULL
+
+static uint64_t now_ns(void)
 {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
 
-    // TODO: wait, obtain mutex, wait, release mutex as described by thread_data structure
-    // hint: use a cast like the one below to obtain thread arguments from your parameter
-    //struct thread_data* thread_func_args = (struct thread_data *) thread_param;
-    struct thread_data* thread_func_args = (struct thread_data *) thread_param;
-    sleep(thread_func_args->wait_to_obtain_ms / 1000);
-    pthread_mutex_lock(thread_func_args->mutex);
-    sleep(thread_func_args->wait_to_release_ms / 1000);
-    pthread_mutex_unlock(thread_func_args->mutex);
-    thread_func_args->thread_complete_success = true;
+/**
+ * Sleep until the absolute CLOCK_MONOTONIC time @param deadline_ns, so time spent before the
+ * call is not added to the wait the way a relative sleep would.
+ * @return how late the wake up came, in ns
+ */
+static int64_t sleep_until(uint64_t deadline_ns)
+{
+    struct timespec ts = {
+        .tv_sec = deadline_ns / NSEC_PER_SEC,
+        .tv_nsec = deadline_ns % NSEC_PER_SEC,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR){
+    }
+    return (int64_t)(now_ns() - deadline_ns);
+}
+
+static uint64_t ms_to_ns(int ms)
+{
+    return ms > 0 ? ms * NSEC_PER_MSEC : 0;
+}
+
+/**
+ * Wait, obtain the mutex, wait and release it as described by @param data.
+ */
+static void run_thread_data(struct thread_data* data)
+{
+    uint64_t deadline = data->start_ns + ms_to_ns(data->wait_to_obtain_ms);
+
+    data->thread_complete_success = false;
+    data->obtain_late_ns = sleep_until(deadline);
+    if (lockprof_mutex_lock(data->mutex) != 0){
+        ERROR_LOG("Cannot obtain mutex");
+        return;
+    }
+    deadline = now_ns() + ms_to_ns(data->wait_to_release_ms);
+    data->release_late_ns = sleep_until(deadline);
+    if (lockprof_mutex_unlock(data->mutex) != 0){
+        ERROR_LOG("Cannot release mutex");
+        return;
+    }
+    data->thread_complete_success = true;
+}
+
+void* threadfunc(void* thread_param)
+{
+    run_thread_data((struct thread_data *) thread_param);
     pthread_exit(thread_param);
 }
 
 
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms)
 {
-    /**
-     * TODO: allocate memory for thread_data, setup mutex and wait arguments, pass thread_data to created thread
-     * using threadfunc() as entry point.
-     *
-     * return true if successful.
-     *
-     * See implementation details in threading.h file comment block
-     */
-
-    struct thread_data* thread_param = malloc(sizeof(struct thread_data));
+    struct thread_data* thread_param = calloc(1, sizeof(struct thread_data));
+    if (thread_param == NULL){
+        return false;
+    }
     thread_param->wait_to_obtain_ms = wait_to_obtain_ms;
     thread_param->wait_to_release_ms = wait_to_release_ms;
     thread_param->mutex = mutex;
+    // the wait counts from the request, not from whenever the new thread first runs
+    thread_param->start_ns = now_ns();
     int ret = pthread_create(thread, NULL, &threadfunc, thread_param);
     if (ret!=0){
+        free(thread_param);
         return false;
     }
 
     return true;
 }
 
+#define WHEEL_SLOTS 512
+
+enum wheel_stage{
+    STAGE_OBTAIN,
+    STAGE_RELEASE,
+};
+
+/**
+ * One thread of a timer wheel. Tasks hash into slots by deadline tick, a slot holds the tasks of
+ * every tick congruent to it and those of a later round stay there until their tick comes.
+ */
+struct wheel_worker{
+    struct timer_wheel* wheel;
+    pthread_t thread;
+    // handed over by timer_wheel_schedule(), protected by the wheel lock
+    struct thread_data* incoming;
+    pthread_cond_t wake;
+    // only touched by the worker thread
+    struct thread_data* slots[WHEEL_SLOTS];
+    size_t ntasks;
+    uint64_t tick;          // last tick processed
+};
+
+struct timer_wheel{
+    pthread_mutex_t lock;
+    pthread_cond_t drained;
+    size_t pending;         // scheduled but not completed, protected by lock
+    bool stopping;
+    unsigned next_worker;
+    unsigned nworkers;
+    uint64_t tick_ns;
+    struct wheel_worker workers[];
+};
+
+static void wheel_insert(struct wheel_worker* worker, struct thread_data* data)
+{
+    // the first tick at or after the deadline, so it is not visited early and inserted again
+    uint64_t tick = (data->deadline_ns + worker->wheel->tick_ns - 1) / worker->wheel->tick_ns;
+    // a deadline already passed is handled on the next tick
+    struct thread_data** slot = &worker->slots[(tick > worker->tick ? tick : worker->tick + 1) % WHEEL_SLOTS];
+    data->next = *slot;
+    *slot = data;
+}
+
+static void wheel_complete(struct timer_wheel* wheel, size_t done)
+{
+    pthread_mutex_lock(&wheel->lock);
+    wheel->pending -= done;
+    if (wheel->pending == 0){
+        pthread_cond_broadcast(&wheel->drained);
+    }
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+/**
+ * Run the due tasks of the slot of @param tick, re-inserting the others.
+ * @return the number of tasks completed
+ */
+static size_t wheel_run_slot(struct wheel_worker* worker, uint64_t tick, uint64_t now)
+{
+    struct thread_data* task = worker->slots[tick % WHEEL_SLOTS];
+    struct thread_data* next;
+    size_t done = 0;
+
+    worker->slots[tick % WHEEL_SLOTS] = NULL;
+    for (; task != NULL; task = next){
+        next = task->next;
+        if (task->deadline_ns > now){
+            wheel_insert(worker, task);
+            continue;
+        }
+        if (task->stage == STAGE_OBTAIN){
+            if (task->obtain_late_ns < 0){
+                task->obtain_late_ns = now - task->deadline_ns;
+            }
+            if (lockprof_mutex_trylock(task->mutex) != 0){
+                // contended, try again on the next tick
+                wheel_insert(worker, task);
+                continue;
+            }
+            task->stage = STAGE_RELEASE;
+            task->deadline_ns = now + ms_to_ns(task->wait_to_release_ms);
+            wheel_insert(worker, task);
+            continue;
+        }
+        task->release_late_ns = now - task->deadline_ns;
+        task->thread_complete_success = lockprof_mutex_unlock(task->mutex) == 0;
+        worker->ntasks--;
+        done++;
+    }
+    return done;
+}
+
+static void* wheel_thread(void* arg)
+{
+    struct wheel_worker* worker = arg;
+    struct timer_wheel* wheel = worker->wheel;
+    struct thread_data* incoming;
+    struct thread_data* next;
+    uint64_t now;
+    uint64_t tick;
+    size_t done;
+
+    worker->tick = now_ns() / wheel->tick_ns;
+    for (;;){
+        pthread_mutex_lock(&wheel->lock);
+        while (worker->incoming == NULL && worker->ntasks == 0 && !wheel->stopping){
+            pthread_cond_wait(&worker->wake, &wheel->lock);
+        }
+        incoming = worker->incoming;
+        worker->incoming = NULL;
+        if (wheel->stopping && incoming == NULL && worker->ntasks == 0){
+            pthread_mutex_unlock(&wheel->lock);
+            break;
+        }
+        pthread_mutex_unlock(&wheel->lock);
+
+        if (worker->ntasks == 0){
+            // idle until now, do not replay the ticks slept through
+            worker->tick = now_ns() / wheel->tick_ns;
+        }
+        for (; incoming != NULL; incoming = next){
+            next = incoming->next;
+            wheel_insert(worker, incoming);
+            worker->ntasks++;
+        }
+
+        sleep_until((worker->tick + 1) * wheel->tick_ns);
+        now = now_ns();
+        tick = now / wheel->tick_ns;
+        done = 0;
+        // catch up on every tick missed, a full round at most
+        if (tick - worker->tick > WHEEL_SLOTS){
+            worker->tick = tick - WHEEL_SLOTS;
+        }
+        while (worker->tick < tick){
+            worker->tick++;
+            done += wheel_run_slot(worker, worker->tick, now);
+        }
+        if (done > 0){
+            wheel_complete(wheel, done);
+        }
+    }
+    return NULL;
+}
+
+struct timer_wheel* timer_wheel_create(unsigned nthreads, unsigned tick_us)
+{
+    struct timer_wheel* wheel;
+    unsigned i;
+
+    if (nthreads == 0 || tick_us == 0){
+        return NULL;
+    }
+    wheel = calloc(1, sizeof(*wheel) + nthreads * sizeof(wheel->workers[0]));
+    if (wheel == NULL){
+        return NULL;
+    }
+    pthread_mutex_init(&wheel->lock, NULL);
+    pthread_cond_init(&wheel->drained, NULL);
+    wheel->tick_ns = tick_us * 1000ULL;
+    for (i = 0; i < nthreads; i++){
+        struct wheel_worker* worker = &wheel->workers[i];
+        worker->wheel = wheel;
+        pthread_cond_init(&worker->wake, NULL);
+        if (pthread_create(&worker->thread, NULL, wheel_thread, worker) != 0){
+            pthread_cond_destroy(&worker->wake);
+            break;
+        }
+        wheel->nworkers++;
+    }
+    if (wheel->nworkers == 0){
+        ERROR_LOG("Cannot start timer wheel threads");
+        timer_wheel_destroy(wheel);
+        return NULL;
+    }
+    return wheel;
+}
+
+bool timer_wheel_schedule(struct timer_wheel* wheel, struct thread_data* data)
+{
+    struct wheel_worker* worker;
+
+    data->thread_complete_success = false;
+    data->start_ns = now_ns();
+    data->deadline_ns = data->start_ns + ms_to_ns(data->wait_to_obtain_ms);
+    data->obtain_late_ns = -1;
+    data->release_late_ns = -1;
+    data->stage = STAGE_OBTAIN;
+
+    pthread_mutex_lock(&wheel->lock);
+    if (wheel->stopping){
+        pthread_mutex_unlock(&wheel->lock);
+        return false;
+    }
+    // a task stays on one worker, so the thread releasing the mutex is the one that obtained it
+    worker = &wheel->workers[wheel->next_worker++ % wheel->nworkers];
+    data->next = worker->incoming;
+    worker->incoming = data;
+    wheel->pending++;
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&wheel->lock);
+    return true;
+}
+
+void timer_wheel_drain(struct timer_wheel* wheel)
+{
+    pthread_mutex_lock(&wheel->lock);
+    while (wheel->pending > 0){
+        pthread_cond_wait(&wheel->drained, &wheel->lock);
+    }
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+void timer_wheel_destroy(struct timer_wheel* wheel)
+{
+    unsigned i;
+
+    if (wheel == NULL){
+        return;
+    }
+    pthread_mutex_lock(&wheel->lock);
+    wheel->stopping = true;
+    for (i = 0; i < wheel->nworkers; i++){
+        pthread_cond_signal(&wheel->workers[i].wake);
+    }
+    pthread_mutex_unlock(&wheel->lock);
+    // the workers finish what they hold before exiting
+    for (i = 0; i < wheel->nworkers; i++){
+        pthread_join(wheel->workers[i].thread, NULL);
+        pthread_cond_destroy(&wheel->workers[i].wake);
+    }
+    pthread_cond_destroy(&wheel->drained);
+    pthread_mutex_destroy(&wheel->lock);
+    free(wheel);
+}
+
+static int compare_ns(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*) a;
+    int64_t y = *(const int64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void fill_stats(int64_t* samples, size_t count, struct jitter_stats* stats)
+{
+    int64_t sum = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->count = count;
+    if (count == 0){
+        return;
+    }
+    qsort(samples, count, sizeof(*samples), compare_ns);
+    for (size_t i = 0; i < count; i++){
+        sum += samples[i];
+    }
+    stats->min_ns = samples[0];
+    stats->mean_ns = sum / (int64_t) count;
+    stats->p99_ns = samples[(count * 99) / 100 < count ? (count * 99) / 100 : count - 1];
+    stats->max_ns = samples[count - 1];
+}
+
+void thread_jitter_stats(struct thread_data* const* data, size_t count, struct jitter_stats* obtain,
+        struct jitter_stats* release)
+{
+    int64_t* obtained = malloc((count ? count : 1) * sizeof(*obtained));
+    int64_t* released = malloc((count ? count : 1) * sizeof(*released));
+    size_t nobtained = 0;
+    size_t nreleased = 0;
+
+    if (obtained == NULL || released == NULL){
+        free(obtained);
+        free(released);
+        fill_stats(NULL, 0, obtain);
+        fill_stats(NULL, 0, release);
+        return;
+    }
+    // only completed work has both samples
+    for (size_t i = 0; i < count; i++){
+        if (data[i]->thread_complete_success){
+            obtained[nobtained++] = data[i]->obtain_late_ns;
+            released[nreleased++] = data[i]->release_late_ns;
+        }
+    }
+    fill_stats(obtained, nobtained, obtain);
+    fill_stats(released, nreleased, release);
+    free(obtained);
+    free(released);
+}
+
+#define POOL_NONE UINT32_MAX
+
+/**
+ * A task of a thread pool, the handle given out is the address of data
+ */
+struct pool_slot{
+    struct thread_data data;
+    _Atomic uint32_t next;      // next free slot while on the freelist
+    bool done;                  // protected by the pool lock
+};
+
+struct thread_pool{
+    /**
+     * Freelist of slots, a Treiber stack. The low 32 bits hold the index of the top slot, the
+     * high ones a tag bumped on every pop so a slot popped and pushed back in between cannot
+     * fool a compare and swap (ABA).
+     */
+    _Atomic uint64_t free_head;
+    struct pool_slot* slots;
+    size_t capacity;
+    // queue of started slots, it cannot hold more than capacity
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t completed;
+    uint32_t* queue;
+    size_t queue_head;
+    size_t queue_count;
+    bool stopping;
+    unsigned nworkers;
+    pthread_t workers[];
+};
+
+static void pool_free_push(struct thread_pool* pool, uint32_t index)
+{
+    uint64_t head = atomic_load_explicit(&pool->free_head, memory_order_relaxed);
+    uint64_t next;
+
+    do {
+        atomic_store_explicit(&pool->slots[index].next, (uint32_t) head, memory_order_relaxed);
+        next = (head & ~(uint64_t) UINT32_MAX) | index;
+    } while (!atomic_compare_exchange_weak_explicit(&pool->free_head, &head, next,
+                memory_order_release, memory_order_relaxed));
+}
+
+static uint32_t pool_free_pop(struct thread_pool* pool)
+{
+    uint64_t head = atomic_load_explicit(&pool->free_head, memory_order_acquire);
+    uint64_t next;
+    uint32_t index;
+
+    do {
+        index = (uint32_t) head;
+        if (index == POOL_NONE){
+            return POOL_NONE;
+        }
+        // may read a slot popped meanwhile, the tag then makes the exchange fail
+        next = ((head >> 32) + 1) << 32 | atomic_load_explicit(&pool->slots[index].next, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->free_head, &head, next,
+                memory_order_acquire, memory_order_acquire));
+    return index;
+}
+
+static void* pool_worker(void* arg)
+{
+    struct thread_pool* pool = arg;
+    struct pool_slot* slot;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;){
+        while (pool->queue_count == 0 && !pool->stopping){
+            pthread_cond_wait(&pool->queued, &pool->lock);
+        }
+        if (pool->queue_count == 0){
+            break;
+        }
+        slot = &pool->slots[pool->queue[pool->queue_head]];
+        pool->queue_head = (pool->queue_head + 1) % pool->capacity;
+        pool->queue_count--;
+        pthread_mutex_unlock(&pool->lock);
+
+        // the worker sleeps through both waits, tasks queued behind it wait their turn
+        run_thread_data(&slot->data);
+
+        pthread_mutex_lock(&pool->lock);
+        slot->done = true;
+        pthread_cond_broadcast(&pool->completed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+struct thread_pool* thread_pool_create(unsigned nthreads, size_t capacity)
+{
+    struct thread_pool* pool;
+
+    if (nthreads == 0 || capacity == 0 || capacity >= POOL_NONE){
+        return NULL;
+    }
+    pool = calloc(1, sizeof(*pool) + nthreads * sizeof(pool->workers[0]));
+    if (pool == NULL){
+        return NULL;
+    }
+    pool->slots = calloc(capacity, sizeof(*pool->slots));
+    pool->queue = calloc(capacity, sizeof(*pool->queue));
+    if (pool->slots == NULL || pool->queue == NULL){
+        free(pool->slots);
+        free(pool->queue);
+        free(pool);
+        return NULL;
+    }
+    pool->capacity = capacity;
+    atomic_init(&pool->free_head, POOL_NONE);
+    for (size_t i = capacity; i-- > 0; ){
+        pool_free_push(pool, i);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->queued, NULL);
+    pthread_cond_init(&pool->completed, NULL);
+    for (unsigned i = 0; i < nthreads; i++){
+        if (pthread_create(&pool->workers[i], NULL, pool_worker, pool) != 0){
+            break;
+        }
+        pool->nworkers++;
+    }
+    if (pool->nworkers == 0){
+        ERROR_LOG("Cannot start pool threads");
+        thread_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+struct thread_data* thread_pool_start(struct thread_pool* pool, pthread_mutex_t* mutex,
+        int wait_to_obtain_ms, int wait_to_release_ms)
+{
+    uint32_t index = pool_free_pop(pool);
+    struct pool_slot* slot;
+
+    if (index == POOL_NONE){
+        return NULL;
+    }
+    slot = &pool->slots[index];
+    memset(&slot->data, 0, sizeof(slot->data));
+    slot->data.wait_to_obtain_ms = wait_to_obtain_ms;
+    slot->data.wait_to_release_ms = wait_to_release_ms;
+    slot->data.mutex = mutex;
+    slot->data.start_ns = now_ns();
+
+    pthread_mutex_lock(&pool->lock);
+    slot->done = false;
+    pool->queue[(pool->queue_head + pool->queue_count) % pool->capacity] = index;
+    pool->queue_count++;
+    pthread_cond_signal(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+    return &slot->data;
+}
+
+bool thread_pool_join(struct thread_pool* pool, struct thread_data* handle)
+{
+    struct pool_slot* slot = (struct pool_slot*) handle;
+    bool success;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!slot->done){
+        pthread_cond_wait(&pool->completed, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    success = handle->thread_complete_success;
+    pool_free_push(pool, slot - pool->slots);
+    return success;
+}
+
+void thread_pool_destroy(struct thread_pool* pool)
+{
+    if (pool == NULL){
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->queued);
+    pthread_mutex_unlock(&pool->lock);
+    for (unsigned i = 0; i < pool->nworkers; i++){
+        pthread_join(pool->workers[i], NULL);
+    }
+    pthread_cond_destroy(&pool->queued);
+    pthread_cond_destroy(&pool->completed);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->slots);
+    free(pool->queue);
+    free(pool);
+}
@@ -1,4 +1,6 @@
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
 
 /**
@@ -22,6 +24,23 @@ struct thread_data{
      * if an error occurred.
      */
     bool thread_complete_success;
+    /**
+     * CLOCK_MONOTONIC time in ns both waits are counted from, set when the work is started.
+     * The release wait starts once the mutex is obtained.
+     */
+    uint64_t start_ns;
+    /**
+     * How late, in ns, the wake ups to obtain and to release the mutex came after their
+     * deadlines, waiting for a contended mutex is not included
+     */
+    int64_t obtain_late_ns;
+    int64_t release_late_ns;
+    /**
+     * Owned by the timer wheel while the work is scheduled on it
+     */
+    struct thread_data* next;
+    uint64_t deadline_ns;
+    int stage;
 };
 
 
@@ -40,3 +59,87 @@ struct thread_data{
 * @return true if the thread could be started, false if a failure occurred.
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+ * Delayed obtain/release work run by a few threads, each with its own hashed timer wheel.
+ * A thread only sleeps until its next tick, instead of one thread sleeping per request.
+ */
+struct timer_wheel;
+
+/**
+ * Start @param nthreads threads ticking every @param tick_us microseconds.
+ * A task runs on the first tick at or after its deadline, so each of its two wake ups comes up
+ * to a tick late, half a tick on average, on top of the wake up latency of the thread. A busy
+ * thread wakes up every tick whether or not a task is due: a 100 us tick keeps the lateness
+ * near the one of a thread per task, a longer one trades lateness for fewer wake ups.
+ * @return NULL on failure
+ */
+struct timer_wheel* timer_wheel_create(unsigned nthreads, unsigned tick_us);
+
+/**
+ * Schedule the waits described by @param data, which must stay valid until it completes:
+ * after wait_to_obtain_ms obtain the mutex, hold it for wait_to_release_ms, then release it
+ * and set thread_complete_success. A contended mutex is retried every tick, a task is always
+ * released by the thread that obtained the mutex.
+ * @return false if the wheel is shutting down
+ */
+bool timer_wheel_schedule(struct timer_wheel* wheel, struct thread_data* data);
+
+/**
+ * Block until every scheduled task has completed.
+ */
+void timer_wheel_drain(struct timer_wheel* wheel);
+
+/**
+ * Drain, stop the threads and free @param wheel.
+ */
+void timer_wheel_destroy(struct timer_wheel* wheel);
+
+struct jitter_stats{
+    size_t count;
+    int64_t min_ns;
+    int64_t mean_ns;
+    int64_t p99_ns;
+    int64_t max_ns;
+};
+
+/**
+ * Summarize the wake up lateness of @param count completed @param data, whether they ran on
+ * threads or on a timer wheel.
+ */
+void thread_jitter_stats(struct thread_data* const* data, size_t count, struct jitter_stats* obtain,
+        struct jitter_stats* release);
+
+/**
+ * Fixed set of worker threads running obtain/release work, with the thread_data of every
+ * task drawn from a preallocated slab instead of malloc, and no thread created per task.
+ * Tasks are serialized per worker: a task holds its worker through both of its waits, so
+ * with more tasks in flight than workers the queued ones start, and reach their deadlines,
+ * late by the length of the tasks ahead of them. The pool suits short or zero waits, the
+ * timer wheel many concurrent timed waits.
+ */
+struct thread_pool;
+
+/**
+ * Start @param nthreads workers able to hold @param capacity tasks started and not yet joined.
+ * @return NULL on failure
+ */
+struct thread_pool* thread_pool_create(unsigned nthreads, size_t capacity);
+
+/**
+ * Same work as start_thread_obtaining_mutex(), run by a worker of @param pool.
+ * @return the handle to pass to thread_pool_join(), NULL if all capacity tasks are in use
+ */
+struct thread_data* thread_pool_start(struct thread_pool* pool, pthread_mutex_t* mutex,
+        int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+ * Wait for the task of @param handle, which goes back to the pool and must not be used again.
+ * @return its thread_complete_success
+ */
+bool thread_pool_join(struct thread_pool* pool, struct thread_data* handle);
+
+/**
+ * Finish the queued tasks, stop the workers and free @param pool, tasks not joined included.
+ */
+void thread_pool_destroy(struct thread_pool* pool);
@@ -0,0 +1,72 @@
+#!/bin/sh
+# Compares the native finder against grep -F on a synthetic tree
+# Usage: finder-bench.sh [number of files] [lines per file] [bench directory]
+
+set -e
+set -u
+
+NUMFILES=${1:-2000}
+NUMLINES=${2:-2000}
+BENCHDIR=${3:-/tmp/finder-bench}
+PATTERNS="AELD_IS_FUN ioctl_seekto circular_buffer"
+
+finder=$(dirname $0)/finder
+if [ ! -x "$finder" ]; then
+	echo "Build the finder first with make finder"
+	exit 1
+fi
+
+if [ ! -d "$BENCHDIR" ]; then
+	echo "Generating ${NUMFILES} files of ${NUMLINES} lines in ${BENCHDIR}"
+	mkdir -p "$BENCHDIR"
+	# one in a hundred lines holds one of the patterns
+	awk -v files="$NUMFILES" -v lines="$NUMLINES" -v dir="$BENCHDIR" -v pats="$PATTERNS" 'BEGIN {
+		srand(42)
+		npat = split(pats, pat, " ")
+		for (f = 0; f < files; f++) {
+			path = sprintf("%s/%02d/file%d.txt", dir, f % 64, f)
+			if (f < 64)
+				system("mkdir -p " dir "/" sprintf("%02d", f))
+			for (l = 0; l < lines; l++) {
+				line = sprintf("%08x the quick brown fox jumps over the lazy dog %d", int(rand() * 2^31), l)
+				if (rand() < 0.01)
+					line = line " " pat[1 + int(rand() * npat)]
+				print line > path
+			}
+			close(path)
+		}
+	}'
+fi
+
+# warm the page cache so both tools read from memory
+cat $(find "$BENCHDIR" -type f) > /dev/null
+
+now() {
+	date +%s.%N
+}
+
+elapsed() {
+	awk -v start="$1" -v end="$2" 'BEGIN { printf "%.3f", end - start }'
+}
+
+for pattern in $PATTERNS; do
+	start=$(now)
+	"$finder" "$BENCHDIR" "$pattern" > /dev/null
+	native=$(elapsed $start $(now))
+	start=$(now)
+	grep -rF -- "$pattern" "$BENCHDIR" | wc -l > /dev/null
+	grep -rlF -- "$pattern" "$BENCHDIR" | wc -l > /dev/null
+	reference=$(elapsed $start $(now))
+	echo "${pattern}: finder ${native}s grep -F ${reference}s"
+done
+
+start=$(now)
+"$finder" "$BENCHDIR" $PATTERNS > /dev/null
+native=$(elapsed $start $(now))
+start=$(now)
+for pattern in $PATTERNS; do
+	grep -rF -- "$pattern" "$BENCHDIR" | wc -l > /dev/null
+	grep -rlF -- "$pattern" "$BENCHDIR" | wc -l > /dev/null
+done
+reference=$(elapsed $start $(now))
+echo "all patterns in one scan: finder ${native}s grep -F ${reference}s"
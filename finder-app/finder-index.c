@@ -0,0 +1,507 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "finder-index.h"
+
+#define INDEX_MAGIC 0x58444946 /* "FIDX" */
+#define INDEX_VERSION 1
+#define INDEX_UNKNOWN (-1)
+
+/**
+ * The file is a header, the entries sorted by path hash then path, and the string table
+ * holding patterns and paths. It is a local cache, fields are in host byte order.
+ */
+typedef struct index_header{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t npatterns;
+    uint32_t reserved;
+    uint64_t nentries;
+    uint64_t strings_len;
+    uint64_t generation;            // bumped by every save
+    struct{
+        uint64_t off;               // in the string table
+        uint64_t len;
+        uint64_t last_used;         // generation of the last run searching it
+    } patterns[INDEX_MAX_PATTERNS];
+} index_header;
+
+typedef struct index_entry{
+    uint64_t hash;
+    uint64_t path_off;
+    uint64_t path_len;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t counts[INDEX_MAX_PATTERNS];     // INDEX_UNKNOWN when not counted
+} index_entry;
+
+/**
+ * A file seen by this run, with the old entry still matching it if any
+ */
+typedef struct index_update{
+    char* path;
+    struct stat st;
+    const index_entry* old;
+    long counts[INDEX_MAX_PATTERNS];
+} index_update;
+
+struct finder_index{
+    char* path;
+    char* root;
+    size_t root_len;
+    const char* const* patterns;
+    size_t npatterns;
+    // the mapped index of the previous run, empty when there is none
+    void* map;
+    size_t map_len;
+    const index_header* hdr;
+    const index_entry* entries;
+    const char* strings;
+    struct timespec written;        // mtime of the index file, for the racy check
+    // per pattern of this run, its column in the old index or -1
+    int old_column[INDEX_MAX_PATTERNS];
+    // protects updates and seen
+    pthread_mutex_t lock;
+    index_update* updates;
+    size_t nupdates;
+    size_t capupdates;
+    unsigned char* seen;            // per old entry, recorded again by this run
+};
+
+static uint64_t hash_path(const char* path, size_t len){
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++){
+        hash ^= (unsigned char) path[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static int compare_key(uint64_t hash, const char* path, size_t len, uint64_t other_hash,
+        const char* other_path, size_t other_len){
+    int cmp;
+    if (hash != other_hash){
+        return hash < other_hash ? -1 : 1;
+    }
+    cmp = memcmp(path, other_path, len < other_len ? len : other_len);
+    if (cmp != 0){
+        return cmp;
+    }
+    return len < other_len ? -1 : len > other_len;
+}
+
+static bool index_validate(const finder_index* idx){
+    const index_header* hdr = idx->map;
+    size_t entries_len;
+
+    if (idx->map_len < sizeof(*hdr) || hdr->magic != INDEX_MAGIC || hdr->version != INDEX_VERSION ||
+            hdr->npatterns > INDEX_MAX_PATTERNS){
+        return false;
+    }
+    if (hdr->nentries > (idx->map_len - sizeof(*hdr)) / sizeof(index_entry)){
+        return false;
+    }
+    entries_len = hdr->nentries * sizeof(index_entry);
+    if (hdr->strings_len != idx->map_len - sizeof(*hdr) - entries_len){
+        return false;
+    }
+    for (uint32_t c = 0; c < hdr->npatterns; c++){
+        if (hdr->patterns[c].off > hdr->strings_len || hdr->patterns[c].len > hdr->strings_len - hdr->patterns[c].off){
+            return false;
+        }
+    }
+    // paths are only checked on lookup, a corrupt one simply never matches
+    return true;
+}
+
+static void index_map(finder_index* idx){
+    struct stat st;
+    void* map;
+    int fd = open(idx->path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0){
+        if (errno != ENOENT){
+            syslog(LOG_ERR, "Cannot open index %s: %s", idx->path, strerror(errno));
+        }
+        return;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0){
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        syslog(LOG_ERR, "Cannot map index %s: %s", idx->path, strerror(errno));
+        return;
+    }
+    idx->map = map;
+    idx->map_len = st.st_size;
+    if (!index_validate(idx)){
+        syslog(LOG_WARNING, "Ignoring invalid index %s", idx->path);
+        munmap(map, st.st_size);
+        idx->map = NULL;
+        idx->map_len = 0;
+        return;
+    }
+    idx->hdr = map;
+    idx->entries = (const index_entry*)(idx->hdr + 1);
+    idx->strings = (const char*)(idx->entries + idx->hdr->nentries);
+    idx->written = st.st_mtim;
+    idx->seen = calloc(idx->hdr->nentries ? idx->hdr->nentries : 1, 1);
+}
+
+finder_index* index_open(const char* path, const char* root, const char* const* patterns, size_t count){
+    finder_index* idx;
+
+    if (count > INDEX_MAX_PATTERNS){
+        syslog(LOG_WARNING, "Not using the index for more than %d patterns", INDEX_MAX_PATTERNS);
+        return NULL;
+    }
+    idx = calloc(1, sizeof(*idx));
+    if (idx == NULL){
+        return NULL;
+    }
+    pthread_mutex_init(&idx->lock, NULL);
+    idx->path = strdup(path);
+    idx->root = strdup(root);
+    if (idx->path == NULL || idx->root == NULL){
+        index_close(idx);
+        return NULL;
+    }
+    idx->root_len = strlen(root);
+    idx->patterns = patterns;
+    idx->npatterns = count;
+
+    index_map(idx);
+    if (idx->map != NULL && idx->seen == NULL){
+        index_close(idx);
+        return NULL;
+    }
+    for (size_t p = 0; p < count; p++){
+        idx->old_column[p] = -1;
+        for (uint32_t c = 0; idx->hdr != NULL && c < idx->hdr->npatterns; c++){
+            if (idx->hdr->patterns[c].len == strlen(patterns[p]) &&
+                    memcmp(idx->strings + idx->hdr->patterns[c].off, patterns[p], idx->hdr->patterns[c].len) == 0){
+                idx->old_column[p] = c;
+                break;
+            }
+        }
+    }
+    return idx;
+}
+
+/**
+ * @return the old entry for @param path if it still describes the file behind @param st
+ */
+static const index_entry* find_entry(const finder_index* idx, const char* path, const struct stat* st){
+    size_t len = strlen(path);
+    uint64_t hash = hash_path(path, len);
+    size_t lo = 0;
+    size_t hi = idx->hdr != NULL ? idx->hdr->nentries : 0;
+    const index_entry* entry = NULL;
+
+    while (lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        const index_entry* e = &idx->entries[mid];
+        int cmp;
+        if (e->path_off > idx->hdr->strings_len || e->path_len > idx->hdr->strings_len - e->path_off){
+            return NULL;
+        }
+        cmp = compare_key(hash, path, len, e->hash, idx->strings + e->path_off, e->path_len);
+        if (cmp == 0){
+            entry = e;
+            break;
+        }
+        if (cmp < 0){
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    if (entry == NULL || entry->dev != (uint64_t) st->st_dev || entry->ino != (uint64_t) st->st_ino ||
+            entry->size != (uint64_t) st->st_size || entry->mtime_sec != st->st_mtim.tv_sec ||
+            entry->mtime_nsec != st->st_mtim.tv_nsec){
+        return NULL;
+    }
+    // modified in the same tick the index was written, a later change could keep this mtime
+    if (entry->mtime_sec > idx->written.tv_sec ||
+            (entry->mtime_sec == idx->written.tv_sec && entry->mtime_nsec >= idx->written.tv_nsec)){
+        return NULL;
+    }
+    return entry;
+}
+
+bool index_lookup(const finder_index* idx, const char* path, const struct stat* st, long* lines){
+    const index_entry* entry = find_entry(idx, path, st);
+
+    if (entry == NULL){
+        return false;
+    }
+    for (size_t p = 0; p < idx->npatterns; p++){
+        if (idx->old_column[p] < 0 || entry->counts[idx->old_column[p]] == INDEX_UNKNOWN){
+            return false;
+        }
+    }
+    for (size_t p = 0; p < idx->npatterns; p++){
+        lines[p] = entry->counts[idx->old_column[p]];
+    }
+    return true;
+}
+
+void index_record(finder_index* idx, const char* path, const struct stat* st, const long* lines){
+    const index_entry* old = find_entry(idx, path, st);
+    index_update* update;
+    index_update* grown;
+    char* copy = strdup(path);
+
+    if (copy == NULL){
+        return;
+    }
+    pthread_mutex_lock(&idx->lock);
+    if (idx->nupdates == idx->capupdates){
+        idx->capupdates = idx->capupdates ? idx->capupdates * 2 : 256;
+        grown = realloc(idx->updates, idx->capupdates * sizeof(*idx->updates));
+        if (grown == NULL){
+            pthread_mutex_unlock(&idx->lock);
+            free(copy);
+            return;
+        }
+        idx->updates = grown;
+    }
+    update = &idx->updates[idx->nupdates++];
+    update->path = copy;
+    update->st = *st;
+    update->old = old;
+    memcpy(update->counts, lines, idx->npatterns * sizeof(*lines));
+    if (old != NULL){
+        idx->seen[old - idx->entries] = 1;
+    }
+    pthread_mutex_unlock(&idx->lock);
+}
+
+/**
+ * An entry of the new index before its path lands in the string table
+ */
+typedef struct pending_entry{
+    index_entry entry;
+    const char* path;
+} pending_entry;
+
+static int compare_pending(const void* a, const void* b){
+    const pending_entry* pa = a;
+    const pending_entry* pb = b;
+    return compare_key(pa->entry.hash, pa->path, pa->entry.path_len, pb->entry.hash, pb->path,
+            pb->entry.path_len);
+}
+
+static bool under_root(const finder_index* idx, const char* path, size_t len){
+    return len > idx->root_len && memcmp(path, idx->root, idx->root_len) == 0 &&
+            (path[idx->root_len] == '/' || idx->root[idx->root_len - 1] == '/');
+}
+
+/**
+ * Columns of the new index: the patterns of this run, then the most recently used old ones.
+ * @param from_old receives the old column of each new one, or -1
+ * @param from_run receives the pattern of this run of each new one, or -1
+ * @return the number of columns
+ */
+static size_t pick_columns(const finder_index* idx, int* from_old, int* from_run){
+    size_t ncolumns = 0;
+    bool taken[INDEX_MAX_PATTERNS] = { false };
+
+    for (size_t p = 0; p < idx->npatterns; p++){
+        size_t c;
+        // a pattern given twice shares its column
+        for (c = 0; c < ncolumns; c++){
+            if (strcmp(idx->patterns[from_run[c]], idx->patterns[p]) == 0){
+                break;
+            }
+        }
+        if (c < ncolumns){
+            continue;
+        }
+        from_run[ncolumns] = p;
+        from_old[ncolumns] = idx->old_column[p];
+        if (idx->old_column[p] >= 0){
+            taken[idx->old_column[p]] = true;
+        }
+        ncolumns++;
+    }
+    while (idx->hdr != NULL && ncolumns < INDEX_MAX_PATTERNS){
+        int best = -1;
+        for (uint32_t c = 0; c < idx->hdr->npatterns; c++){
+            if (!taken[c] && (best < 0 || idx->hdr->patterns[c].last_used > idx->hdr->patterns[best].last_used)){
+                best = c;
+            }
+        }
+        if (best < 0){
+            break;
+        }
+        taken[best] = true;
+        from_run[ncolumns] = -1;
+        from_old[ncolumns] = best;
+        ncolumns++;
+    }
+    return ncolumns;
+}
+
+static void fill_counts(index_entry* entry, size_t ncolumns, const int* from_old, const int* from_run,
+        const index_entry* old, const long* run_counts){
+    for (size_t c = 0; c < INDEX_MAX_PATTERNS; c++){
+        entry->counts[c] = INDEX_UNKNOWN;
+        if (c >= ncolumns){
+            continue;
+        }
+        if (from_run[c] >= 0 && run_counts != NULL){
+            entry->counts[c] = run_counts[from_run[c]];
+        } else if (from_old[c] >= 0 && old != NULL){
+            entry->counts[c] = old->counts[from_old[c]];
+        }
+    }
+}
+
+static int write_index(const finder_index* idx, index_header* hdr, pending_entry* pending, size_t npending,
+        const int* from_old, const int* from_run){
+    size_t tmp_len = strlen(idx->path) + 32;
+    char* tmp = malloc(tmp_len);
+    uint64_t strings_len = 0;
+    FILE* out;
+    int saved_errno;
+
+    if (tmp == NULL){
+        return -1;
+    }
+    snprintf(tmp, tmp_len, "%s.tmp.%d", idx->path, (int) getpid());
+    out = fopen(tmp, "w");
+    if (out == NULL){
+        saved_errno = errno;
+        free(tmp);
+        errno = saved_errno;
+        return -1;
+    }
+
+    for (uint32_t c = 0; c < hdr->npatterns; c++){
+        hdr->patterns[c].off = strings_len;
+        hdr->patterns[c].len = from_run[c] >= 0 ? strlen(idx->patterns[from_run[c]]) :
+                idx->hdr->patterns[from_old[c]].len;
+        strings_len += hdr->patterns[c].len;
+    }
+    for (size_t i = 0; i < npending; i++){
+        pending[i].entry.path_off = strings_len;
+        strings_len += pending[i].entry.path_len;
+    }
+    hdr->strings_len = strings_len;
+
+    fwrite(hdr, sizeof(*hdr), 1, out);
+    for (size_t i = 0; i < npending; i++){
+        fwrite(&pending[i].entry, sizeof(pending[i].entry), 1, out);
+    }
+    for (uint32_t c = 0; c < hdr->npatterns; c++){
+        fwrite(from_run[c] >= 0 ? idx->patterns[from_run[c]] : idx->strings + idx->hdr->patterns[from_old[c]].off,
+                1, hdr->patterns[c].len, out);
+    }
+    for (size_t i = 0; i < npending; i++){
+        fwrite(pending[i].path, 1, pending[i].entry.path_len, out);
+    }
+    if (ferror(out) || fclose(out) != 0 || rename(tmp, idx->path) != 0){
+        saved_errno = errno;
+        unlink(tmp);
+        free(tmp);
+        errno = saved_errno;
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+int index_save(finder_index* idx){
+    index_header hdr = { .magic = INDEX_MAGIC, .version = INDEX_VERSION };
+    int from_old[INDEX_MAX_PATTERNS];
+    int from_run[INDEX_MAX_PATTERNS];
+    size_t nold = idx->hdr != NULL ? idx->hdr->nentries : 0;
+    pending_entry* pending;
+    size_t npending = 0;
+    int ret;
+
+    hdr.generation = idx->hdr != NULL ? idx->hdr->generation + 1 : 1;
+    hdr.npatterns = pick_columns(idx, from_old, from_run);
+    for (uint32_t c = 0; c < hdr.npatterns; c++){
+        hdr.patterns[c].last_used = from_run[c] >= 0 ? hdr.generation : idx->hdr->patterns[from_old[c]].last_used;
+    }
+
+    pending = malloc((nold + idx->nupdates + 1) * sizeof(*pending));
+    if (pending == NULL){
+        return -1;
+    }
+    for (size_t i = 0; i < idx->nupdates; i++){
+        const index_update* update = &idx->updates[i];
+        index_entry* entry = &pending[npending].entry;
+        pending[npending++].path = update->path;
+        entry->path_len = strlen(update->path);
+        entry->hash = hash_path(update->path, entry->path_len);
+        entry->dev = update->st.st_dev;
+        entry->ino = update->st.st_ino;
+        entry->size = update->st.st_size;
+        entry->mtime_sec = update->st.st_mtim.tv_sec;
+        entry->mtime_nsec = update->st.st_mtim.tv_nsec;
+        fill_counts(entry, hdr.npatterns, from_old, from_run, update->old, update->counts);
+    }
+    // keep other trees, drop what vanished from the one searched now
+    for (size_t i = 0; i < nold; i++){
+        const index_entry* old = &idx->entries[i];
+        const char* path = idx->strings + old->path_off;
+        if (idx->seen[i] || old->path_off > idx->hdr->strings_len ||
+                old->path_len > idx->hdr->strings_len - old->path_off || under_root(idx, path, old->path_len)){
+            continue;
+        }
+        pending[npending].entry = *old;
+        pending[npending].path = path;
+        fill_counts(&pending[npending].entry, hdr.npatterns, from_old, from_run, old, NULL);
+        npending++;
+    }
+    qsort(pending, npending, sizeof(*pending), compare_pending);
+    // a path recorded twice, e.g. through two routes into the tree, keeps a single entry
+    for (size_t i = 1, kept = 1; i <= npending; i++){
+        if (i == npending){
+            npending = kept;
+            break;
+        }
+        if (compare_pending(&pending[i], &pending[kept - 1]) != 0){
+            pending[kept++] = pending[i];
+        }
+    }
+    hdr.nentries = npending;
+    ret = write_index(idx, &hdr, pending, npending, from_old, from_run);
+    free(pending);
+    return ret;
+}
+
+void index_close(finder_index* idx){
+    if (idx == NULL){
+        return;
+    }
+    for (size_t i = 0; i < idx->nupdates; i++){
+        free(idx->updates[i].path);
+    }
+    free(idx->updates);
+    free(idx->seen);
+    if (idx->map != NULL){
+        munmap(idx->map, idx->map_len);
+    }
+    pthread_mutex_destroy(&idx->lock);
+    free(idx->path);
+    free(idx->root);
+    free(idx);
+}
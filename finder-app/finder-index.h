@@ -0,0 +1,51 @@
+/*
+ * finder-index.h
+ *
+ *  @brief On-disk cache of per-file match counts, so repeat runs only read changed files
+ */
+
+#ifndef FINDER_INDEX_H
+#define FINDER_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/**
+ * Most patterns the index keeps counts for, the least recently searched are dropped first
+ */
+#define INDEX_MAX_PATTERNS 8
+
+typedef struct finder_index finder_index;
+
+/**
+ * Map the index at @param path, a missing or invalid file is treated as an empty index.
+ * @param root canonical directory searched by this run, its entries that are not recorded
+ * again are dropped on save
+ * @param patterns searched by this run
+ * @return NULL if memory is short or there are more than INDEX_MAX_PATTERNS patterns
+ */
+finder_index* index_open(const char* path, const char* root, const char* const* patterns, size_t count);
+
+/**
+ * @return true with @param lines filled, one count per pattern, when @param path is unchanged
+ * since it was indexed, according to @param st, and counted for every pattern of this run.
+ * Safe to call from several threads.
+ */
+bool index_lookup(const finder_index* idx, const char* path, const struct stat* st, long* lines);
+
+/**
+ * Remember the @param lines counted in @param path as it was when @param st was taken.
+ * Safe to call from several threads.
+ */
+void index_record(finder_index* idx, const char* path, const struct stat* st, const long* lines);
+
+/**
+ * Replace the index file with the old entries merged with everything recorded in this run.
+ * @return 0 on success, -1 with errno set otherwise
+ */
+int index_save(finder_index* idx);
+
+void index_close(finder_index* idx);
+
+#endif /* FINDER_INDEX_H */
@@ -0,0 +1,450 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "finder-match.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FINDER_X86 1
+#else
+#define FINDER_X86 0
+#endif
+
+#define ALPHABET 256
+/**
+ * Once built, a transition holds the row offset of the target state, state * stride, so the
+ * scan needs no multiply, with this low bit set when some pattern ends in the target state.
+ */
+#define AC_OUTPUT 1
+/**
+ * Up to this many distinct two byte pattern prefixes, the scan skips from the root state to
+ * the next position holding one of them with SSE2
+ */
+#define AC_MAX_PAIRS 8
+
+typedef const char* (*find_fn)(const char* hay, size_t len, const char* pat, size_t pat_len);
+
+struct matcher{
+    size_t count;
+    char** patterns;
+    size_t* lens;
+    // single pattern search
+    find_fn find;
+    const char* backend;
+    // Aho-Corasick automaton, a complete DFA once built
+    // bytes absent from every pattern share class 0, which keeps the table small enough for L1
+    uint16_t classes[ALPHABET];
+    size_t stride;          // number of classes, rounded up to keep AC_OUTPUT free
+    int32_t* next;          // states * stride transitions, see AC_OUTPUT
+    int32_t* out_start;     // per state, first index in out_list of the patterns ending there
+    int32_t* out_len;
+    int32_t* out_list;
+    size_t states;
+    unsigned char pair_first[AC_MAX_PAIRS];
+    unsigned char pair_second[AC_MAX_PAIRS];
+    size_t npairs;          // 0 when the prefilter cannot be used
+};
+
+static const char* find_scalar(const char* hay, size_t len, const char* pat, size_t pat_len){
+    return memmem(hay, len, pat, pat_len);
+}
+
+#if FINDER_X86
+/**
+ * Compare a whole vector of candidate start positions against the first and the last byte
+ * of the pattern at once, and only memcmp the positions where both match.
+ */
+static const char* find_sse2(const char* hay, size_t len, const char* pat, size_t pat_len){
+    const __m128i first = _mm_set1_epi8(pat[0]);
+    const __m128i last = _mm_set1_epi8(pat[pat_len - 1]);
+    size_t i = 0;
+
+    if (pat_len < 2){
+        return memchr(hay, pat[0], len);
+    }
+    for (; i + pat_len - 1 + 16 <= len; i += 16){
+        __m128i block_first = _mm_loadu_si128((const __m128i*)(hay + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i*)(hay + i + pat_len - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                _mm_cmpeq_epi8(last, block_last)));
+        while (mask != 0){
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, pat + 1, pat_len - 2) == 0){
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return i < len ? memmem(hay + i, len - i, pat, pat_len) : NULL;
+}
+
+__attribute__((target("avx2")))
+static const char* find_avx2(const char* hay, size_t len, const char* pat, size_t pat_len){
+    const __m256i first = _mm256_set1_epi8(pat[0]);
+    const __m256i last = _mm256_set1_epi8(pat[pat_len - 1]);
+    size_t i = 0;
+
+    if (pat_len < 2){
+        return memchr(hay, pat[0], len);
+    }
+    for (; i + pat_len - 1 + 32 <= len; i += 32){
+        __m256i block_first = _mm256_loadu_si256((const __m256i*)(hay + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i*)(hay + i + pat_len - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                _mm256_cmpeq_epi8(last, block_last)));
+        while (mask != 0){
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, pat + 1, pat_len - 2) == 0){
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return i < len ? memmem(hay + i, len - i, pat, pat_len) : NULL;
+}
+#endif
+
+static void pick_find(matcher* m){
+#if FINDER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        m->find = find_avx2;
+        m->backend = "avx2";
+        return;
+    }
+    if (__builtin_cpu_supports("sse2")){
+        m->find = find_sse2;
+        m->backend = "sse2";
+        return;
+    }
+#endif
+    m->find = find_scalar;
+    m->backend = "scalar";
+}
+
+/**
+ * Collect the distinct first two bytes of the patterns for the root skip. A one byte pattern
+ * or too many prefixes leave the prefilter off.
+ */
+static void build_pairs(matcher* m){
+    size_t k;
+
+    m->npairs = 0;
+    for (size_t p = 0; p < m->count; p++){
+        if (m->lens[p] == 0){
+            continue;
+        }
+        if (m->lens[p] < 2){
+            m->npairs = 0;
+            return;
+        }
+        for (k = 0; k < m->npairs; k++){
+            if (m->pair_first[k] == (unsigned char) m->patterns[p][0] &&
+                    m->pair_second[k] == (unsigned char) m->patterns[p][1]){
+                break;
+            }
+        }
+        if (k < m->npairs){
+            continue;
+        }
+        if (m->npairs == AC_MAX_PAIRS){
+            m->npairs = 0;
+            return;
+        }
+        m->pair_first[m->npairs] = m->patterns[p][0];
+        m->pair_second[m->npairs] = m->patterns[p][1];
+        m->npairs++;
+    }
+}
+
+/**
+ * Build the trie of the non-empty patterns, then turn it into a complete DFA breadth first,
+ * merging the outputs of each state with those of its failure state.
+ */
+static int build_automaton(matcher* m){
+    size_t total = 1;
+    size_t states = 1;
+    size_t out_total = 0;
+    int32_t* fail = NULL;
+    int32_t* queue = NULL;
+    int32_t* own = NULL;        // pattern ending exactly at a state, chained through own_next
+    int32_t* own_next = NULL;
+    size_t head = 0;
+    size_t tail = 0;
+    int ret = -1;
+
+    for (size_t p = 0; p < m->count; p++){
+        total += m->lens[p];
+        for (size_t i = 0; i < m->lens[p]; i++){
+            uint16_t* class = &m->classes[(unsigned char) m->patterns[p][i]];
+            if (*class == 0){
+                *class = ++m->stride;
+            }
+        }
+    }
+    m->stride = (m->stride + 2) & ~(size_t) 1;
+    m->next = malloc(total * m->stride * sizeof(*m->next));
+    m->out_start = calloc(total, sizeof(*m->out_start));
+    m->out_len = calloc(total, sizeof(*m->out_len));
+    fail = calloc(total, sizeof(*fail));
+    queue = malloc(total * sizeof(*queue));
+    own = malloc(total * sizeof(*own));
+    own_next = malloc(m->count * sizeof(*own_next));
+    if (!m->next || !m->out_start || !m->out_len || !fail || !queue || !own || !own_next){
+        goto out;
+    }
+    memset(m->next, 0xff, total * m->stride * sizeof(*m->next));
+    memset(own, 0xff, total * sizeof(*own));
+
+    for (size_t p = 0; p < m->count; p++){
+        int32_t state = 0;
+        if (m->lens[p] == 0){
+            continue;
+        }
+        for (size_t i = 0; i < m->lens[p]; i++){
+            int32_t* slot = &m->next[state * m->stride + m->classes[(unsigned char) m->patterns[p][i]]];
+            if (*slot < 0){
+                *slot = states++;
+            }
+            state = *slot;
+        }
+        own_next[p] = own[state];
+        own[state] = p;
+    }
+
+    for (size_t c = 0; c < m->stride; c++){
+        int32_t child = m->next[c];
+        if (child < 0){
+            m->next[c] = 0;
+        } else {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail){
+        int32_t state = queue[head++];
+        for (size_t c = 0; c < m->stride; c++){
+            int32_t* slot = &m->next[state * m->stride + c];
+            if (*slot < 0){
+                *slot = m->next[fail[state] * m->stride + c];
+            } else {
+                fail[*slot] = m->next[fail[state] * m->stride + c];
+                queue[tail++] = *slot;
+            }
+        }
+    }
+
+    // outputs: a state reports its own patterns and everything its failure state reports
+    for (size_t i = 0; i < tail; i++){
+        int32_t state = queue[i];
+        for (int32_t p = own[state]; p >= 0; p = own_next[p]){
+            m->out_len[state]++;
+        }
+        m->out_len[state] += m->out_len[fail[state]];
+        out_total += m->out_len[state];
+    }
+    m->out_list = malloc((out_total ? out_total : 1) * sizeof(*m->out_list));
+    if (m->out_list == NULL){
+        goto out;
+    }
+    out_total = 0;
+    for (size_t i = 0; i < tail; i++){
+        int32_t state = queue[i];
+        int32_t n = 0;
+        m->out_start[state] = out_total;
+        for (int32_t p = own[state]; p >= 0; p = own_next[p]){
+            m->out_list[out_total + n++] = p;
+        }
+        // BFS order, the failure state is shallower and already filled in
+        memcpy(&m->out_list[out_total + n], &m->out_list[m->out_start[fail[state]]],
+                m->out_len[fail[state]] * sizeof(*m->out_list));
+        out_total += m->out_len[state];
+    }
+    for (size_t i = 0; i < states * m->stride; i++){
+        int32_t target = m->next[i];
+        m->next[i] = target * m->stride | (m->out_len[target] > 0 ? AC_OUTPUT : 0);
+    }
+    m->states = states;
+    build_pairs(m);
+    ret = 0;
+out:
+    free(fail);
+    free(queue);
+    free(own);
+    free(own_next);
+    return ret;
+}
+
+matcher* matcher_create(const char* const* patterns, size_t count){
+    matcher* m = calloc(1, sizeof(*m));
+    if (m == NULL){
+        return NULL;
+    }
+    m->count = count;
+    m->patterns = calloc(count, sizeof(*m->patterns));
+    m->lens = calloc(count, sizeof(*m->lens));
+    if (m->patterns == NULL || m->lens == NULL){
+        matcher_destroy(m);
+        return NULL;
+    }
+    for (size_t p = 0; p < count; p++){
+        m->patterns[p] = strdup(patterns[p]);
+        if (m->patterns[p] == NULL){
+            matcher_destroy(m);
+            return NULL;
+        }
+        m->lens[p] = strlen(patterns[p]);
+    }
+    if (count == 1){
+        pick_find(m);
+    } else {
+        m->backend = "aho-corasick";
+        if (build_automaton(m) != 0){
+            matcher_destroy(m);
+            return NULL;
+        }
+    }
+    return m;
+}
+
+void matcher_destroy(matcher* m){
+    if (m == NULL){
+        return;
+    }
+    for (size_t p = 0; p < m->count && m->patterns != NULL; p++){
+        free(m->patterns[p]);
+    }
+    free(m->patterns);
+    free(m->lens);
+    free(m->next);
+    free(m->out_start);
+    free(m->out_len);
+    free(m->out_list);
+    free(m);
+}
+
+const char* matcher_backend(const matcher* m){
+    return m->backend;
+}
+
+static long count_lines(const char* data, size_t len){
+    const char* end = data + len;
+    const char* pos = data;
+    const char* newline;
+    long lines = 0;
+
+    while (pos < end && (newline = memchr(pos, '\n', end - pos)) != NULL){
+        lines++;
+        pos = newline + 1;
+    }
+    return lines + (pos < end);
+}
+
+static long count_single(const matcher* m, const char* data, size_t len){
+    const char* end = data + len;
+    const char* pos = data;
+    const char* hit;
+    const char* newline;
+    size_t pat_len = m->lens[0];
+    long lines = 0;
+
+    while (pos < end && (hit = m->find(pos, end - pos, m->patterns[0], pat_len)) != NULL){
+        lines++;
+        // the rest of the line cannot add another match
+        newline = memchr(hit + pat_len, '\n', end - hit - pat_len);
+        if (newline == NULL){
+            break;
+        }
+        pos = newline + 1;
+    }
+    return lines;
+}
+
+/**
+ * @return the first position from @param pos where a pattern may start, or where the blocks
+ * run out and the automaton has to go on byte by byte
+ */
+static const char* skip_to_candidate(const matcher* m, const char* pos, const char* end){
+#ifdef __SSE2__
+    __m128i first[AC_MAX_PAIRS];
+    __m128i second[AC_MAX_PAIRS];
+
+    for (size_t k = 0; k < m->npairs; k++){
+        first[k] = _mm_set1_epi8(m->pair_first[k]);
+        second[k] = _mm_set1_epi8(m->pair_second[k]);
+    }
+    for (; end - pos >= 17; pos += 16){
+        __m128i block_first = _mm_loadu_si128((const __m128i*) pos);
+        __m128i block_second = _mm_loadu_si128((const __m128i*)(pos + 1));
+        __m128i hits = _mm_setzero_si128();
+        for (size_t k = 0; k < m->npairs; k++){
+            hits = _mm_or_si128(hits, _mm_and_si128(_mm_cmpeq_epi8(first[k], block_first),
+                    _mm_cmpeq_epi8(second[k], block_second)));
+        }
+        unsigned mask = _mm_movemask_epi8(hits);
+        if (mask != 0){
+            return pos + __builtin_ctz(mask);
+        }
+    }
+#else
+    (void) m;
+    (void) end;
+#endif
+    return pos;
+}
+
+static void count_multi(const matcher* m, const char* data, size_t len, long* lines){
+    // per pattern, end of the last line it was counted on, later hits before it add nothing
+    const char** line_end = calloc(m->count, sizeof(*line_end));
+    const char* end = data + len;
+    const char* newline;
+    int32_t row = 0;
+
+    if (line_end == NULL){
+        return;
+    }
+    for (const char* pos = data; pos < end; pos++){
+        // no partial match is pending at the root, nothing can start before the next candidate
+        if (row == 0 && m->npairs > 0){
+            pos = skip_to_candidate(m, pos, end);
+        }
+        row = m->next[(row & ~AC_OUTPUT) + m->classes[(unsigned char) *pos]];
+        if (!(row & AC_OUTPUT)){
+            continue;
+        }
+        int32_t state = row / m->stride;
+        for (int32_t o = 0; o < m->out_len[state]; o++){
+            int32_t p = m->out_list[m->out_start[state] + o];
+            if (line_end[p] != NULL && pos <= line_end[p]){
+                continue;
+            }
+            lines[p]++;
+            newline = memchr(pos, '\n', end - pos);
+            line_end[p] = newline != NULL ? newline : end;
+        }
+    }
+    free(line_end);
+}
+
+void matcher_count_lines(const matcher* m, const char* data, size_t len, long* lines){
+    long total_lines = -1;
+
+    memset(lines, 0, m->count * sizeof(*lines));
+    if (m->count == 1 && m->lens[0] > 0){
+        lines[0] = count_single(m, data, len);
+        return;
+    }
+    if (m->count > 1){
+        count_multi(m, data, len, lines);
+    }
+    // an empty pattern matches every line, including an unterminated last one
+    for (size_t p = 0; p < m->count; p++){
+        if (m->lens[p] == 0){
+            if (total_lines < 0){
+                total_lines = count_lines(data, len);
+            }
+            lines[p] = total_lines;
+        }
+    }
+}
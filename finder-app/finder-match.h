@@ -0,0 +1,35 @@
+/*
+ * finder-match.h
+ *
+ *  @brief Literal string matching for finder, one or several patterns per scan
+ */
+
+#ifndef FINDER_MATCH_H
+#define FINDER_MATCH_H
+
+#include <stddef.h>
+
+typedef struct matcher matcher;
+
+/**
+ * Build a matcher for @param count literal @param patterns. A single pattern is searched
+ * with a SIMD first/last byte filter, several at once with an Aho-Corasick automaton.
+ * @return NULL if memory is short
+ */
+matcher* matcher_create(const char* const* patterns, size_t count);
+
+void matcher_destroy(matcher* m);
+
+/**
+ * Count the lines of @param data holding each pattern, a line counted once per pattern
+ * like grep -F does.
+ * @param lines receives one count per pattern, in the order given to matcher_create()
+ */
+void matcher_count_lines(const matcher* m, const char* data, size_t len, long* lines);
+
+/**
+ * @return the name of the search routine picked for this CPU, for benchmarks
+ */
+const char* matcher_backend(const matcher* m);
+
+#endif /* FINDER_MATCH_H */
@@ -0,0 +1,330 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "finder-index.h"
+#include "finder-match.h"
+
+#define USAGE "Usage: finder [-j threads] [-i index file] [target directory] [search string]..."
+#define QUEUE_CAPACITY 256
+#define MAX_THREADS 16
+
+/**
+ * Bounded queue of file paths, filled by the directory walk and drained by the workers
+ */
+typedef struct work_queue{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    char* paths[QUEUE_CAPACITY];
+    size_t head;
+    size_t count;
+    bool done;              // the walk is over, workers exit once the queue is empty
+} work_queue;
+
+typedef struct search_ctx{
+    work_queue queue;
+    const matcher* match;
+    finder_index* index;    // NULL unless counts are cached between runs
+    size_t npatterns;
+    atomic_long* files;     // per pattern, files with at least one matching line
+    atomic_long* lines;     // per pattern, matching lines over all files
+} search_ctx;
+
+static void queue_push(work_queue* q, char* path){
+    pthread_mutex_lock(&q->lock);
+    while (q->count == QUEUE_CAPACITY){
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    q->paths[(q->head + q->count) % QUEUE_CAPACITY] = path;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * @return the next path to search, owned by the caller, or NULL once the walk is over
+ */
+static char* queue_pop(work_queue* q){
+    char* path = NULL;
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->done){
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    if (q->count > 0){
+        path = q->paths[q->head];
+        q->head = (q->head + 1) % QUEUE_CAPACITY;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return path;
+}
+
+static void queue_finish(work_queue* q){
+    pthread_mutex_lock(&q->lock);
+    q->done = true;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Count the matching lines of every pattern in @param path with a single scan.
+ * @return false if the file was empty or could not be read, @param lines is untouched then
+ */
+static bool search_file(const char* path, const search_ctx* ctx, long* lines){
+    struct stat st;
+    void* data;
+    int fd;
+
+    if (ctx->index != NULL && stat(path, &st) == 0 && index_lookup(ctx->index, path, &st, lines)){
+        // recorded again so the entry outlives this run
+        index_record(ctx->index, path, &st, lines);
+        return true;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0){
+        syslog(LOG_ERR, "Cannot open %s: %s", path, strerror(errno));
+        return false;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0){
+        close(fd);
+        return false;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED){
+        syslog(LOG_ERR, "Cannot map %s: %s", path, strerror(errno));
+        return false;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    matcher_count_lines(ctx->match, data, st.st_size, lines);
+    munmap(data, st.st_size);
+    if (ctx->index != NULL){
+        index_record(ctx->index, path, &st, lines);
+    }
+    return true;
+}
+
+static void* search_worker(void* arg){
+    search_ctx* ctx = arg;
+    size_t n = ctx->npatterns;
+    // per thread totals, folded into the shared counters once at the end
+    long* counts = calloc(3 * n, sizeof(*counts));
+    long* files = counts + n;
+    long* lines = counts + 2 * n;
+    char* path;
+
+    if (counts == NULL){
+        syslog(LOG_ERR, "Out of memory in search worker");
+        return NULL;
+    }
+    while ((path = queue_pop(&ctx->queue)) != NULL){
+        if (search_file(path, ctx, counts)){
+            for (size_t p = 0; p < n; p++){
+                files[p] += counts[p] > 0;
+                lines[p] += counts[p];
+            }
+        }
+        free(path);
+    }
+    for (size_t p = 0; p < n; p++){
+        atomic_fetch_add(&ctx->files[p], files[p]);
+        atomic_fetch_add(&ctx->lines[p], lines[p]);
+    }
+    free(counts);
+    return NULL;
+}
+
+static char* join_path(const char* dir, const char* name){
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char* path = malloc(dir_len + name_len + 2);
+    if (path == NULL){
+        return NULL;
+    }
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+    return path;
+}
+
+/**
+ * Walk @param root once, queueing every regular file. Like grep -r, symlinks below the
+ * root are not followed.
+ */
+static void walk_tree(const char* root, work_queue* q){
+    char** stack = NULL;
+    size_t depth = 0;
+    size_t cap = 0;
+    char* dir_path;
+    char* path;
+    char** grown;
+    DIR* dir;
+    struct dirent* ent;
+    struct stat st;
+    unsigned char type;
+
+    dir_path = strdup(root);
+    while (dir_path != NULL){
+        dir = opendir(dir_path);
+        if (dir == NULL){
+            syslog(LOG_ERR, "Cannot open directory %s: %s", dir_path, strerror(errno));
+        }
+        while (dir != NULL && (ent = readdir(dir)) != NULL){
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0){
+                continue;
+            }
+            path = join_path(dir_path, ent->d_name);
+            if (path == NULL){
+                break;
+            }
+            type = ent->d_type;
+            if (type == DT_UNKNOWN){
+                type = lstat(path, &st) != 0 ? DT_UNKNOWN :
+                        S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type == DT_REG){
+                queue_push(q, path);
+            } else if (type == DT_DIR){
+                if (depth == cap){
+                    cap = cap ? cap * 2 : 16;
+                    grown = realloc(stack, cap * sizeof(*stack));
+                    if (grown == NULL){
+                        free(path);
+                        break;
+                    }
+                    stack = grown;
+                }
+                stack[depth++] = path;
+            } else {
+                free(path);
+            }
+        }
+        if (dir != NULL){
+            closedir(dir);
+        }
+        free(dir_path);
+        dir_path = depth > 0 ? stack[--depth] : NULL;
+    }
+    free(stack);
+}
+
+static int default_threads(void){
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1){
+        return 1;
+    }
+    return cpus > MAX_THREADS ? MAX_THREADS : cpus;
+}
+
+int main(int argc, char** argv){
+    search_ctx ctx = {
+        .queue = {
+            .lock = PTHREAD_MUTEX_INITIALIZER,
+            .not_empty = PTHREAD_COND_INITIALIZER,
+            .not_full = PTHREAD_COND_INITIALIZER,
+        },
+    };
+    pthread_t threads[MAX_THREADS];
+    int nthreads = default_threads();
+    int started = 0;
+    const char* index_path = getenv("FINDER_INDEX");
+    char* root;
+    matcher* match;
+    struct stat st;
+    int opt;
+    int err;
+
+    openlog("finder", 0, LOG_USER);
+    while ((opt = getopt(argc, argv, "j:i:")) != -1){
+        switch (opt){
+            case 'j':
+                nthreads = atoi(optarg);
+                if (nthreads < 1 || nthreads > MAX_THREADS){
+                    printf("Thread count must be between 1 and %d\n", MAX_THREADS);
+                    return 1;
+                }
+                break;
+            case 'i':
+                index_path = optarg;
+                break;
+            default:
+                printf("%s\n", USAGE);
+                return 1;
+        }
+    }
+    if (argc - optind < 2){
+        printf("Invalid args\n%s\n", USAGE);
+        return 1;
+    }
+    if (stat(argv[optind], &st) != 0 || !S_ISDIR(st.st_mode)){
+        printf("Target directory not a directory!\n%s\n", USAGE);
+        return 1;
+    }
+    ctx.npatterns = argc - optind - 1;
+    ctx.match = match = matcher_create((const char* const*) &argv[optind + 1], ctx.npatterns);
+    ctx.files = calloc(ctx.npatterns, sizeof(*ctx.files));
+    ctx.lines = calloc(ctx.npatterns, sizeof(*ctx.lines));
+    if (match == NULL || ctx.files == NULL || ctx.lines == NULL){
+        syslog(LOG_ERR, "Out of memory building the matcher");
+        return 1;
+    }
+    syslog(LOG_DEBUG, "Searching %zu pattern(s) with %s", ctx.npatterns, matcher_backend(match));
+    // index keys are canonical paths, so the same tree reached another way still hits
+    root = realpath(argv[optind], NULL);
+    if (root == NULL){
+        printf("Target directory not a directory!\n%s\n", USAGE);
+        return 1;
+    }
+    if (index_path != NULL && *index_path != '\0'){
+        ctx.index = index_open(index_path, root, (const char* const*) &argv[optind + 1], ctx.npatterns);
+    }
+
+    for (int i = 0; i < nthreads; i++){
+        err = pthread_create(&threads[started], NULL, search_worker, &ctx);
+        if (err != 0){
+            syslog(LOG_ERR, "Cannot start worker: %s", strerror(err));
+            break;
+        }
+        started++;
+    }
+    if (started == 0){
+        return 1;
+    }
+    walk_tree(ctx.index != NULL ? root : argv[optind], &ctx.queue);
+    queue_finish(&ctx.queue);
+    for (int i = 0; i < started; i++){
+        pthread_join(threads[i], NULL);
+    }
+    if (ctx.index != NULL && index_save(ctx.index) != 0){
+        syslog(LOG_ERR, "Cannot save index %s: %s", index_path, strerror(errno));
+    }
+
+    if (ctx.npatterns == 1){
+        printf("The number of files are %ld and the number of matching lines are %ld\n",
+                atomic_load(&ctx.files[0]), atomic_load(&ctx.lines[0]));
+    } else {
+        for (size_t p = 0; p < ctx.npatterns; p++){
+            printf("%s: The number of files are %ld and the number of matching lines are %ld\n",
+                    argv[optind + 1 + p], atomic_load(&ctx.files[p]), atomic_load(&ctx.lines[p]));
+        }
+    }
+    index_close(ctx.index);
+    free(root);
+    free(ctx.files);
+    free(ctx.lines);
+    matcher_destroy(match);
+    return 0;
+}
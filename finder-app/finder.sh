@@ -9,12 +9,22 @@ fi
 filesdir=$1
 searchstr=$2
 
-if [ ! -d $filesdir ]; then
+if [ ! -d "$filesdir" ]; then
     echo "Target directory not a directory!"
     echo "Usage: finder.sh [target directory] [search string]"
     exit 1
 fi
 
-line_found=$( grep -r $searchstr $filesdir | wc -l)
-file_found=$( grep -r $searchstr $filesdir | uniq | wc -l)
+# the native finder counts both in a single parallel pass, with FINDER_INDEX set to a
+# file it also caches the counts there and only rereads changed files on the next run
+finder=$(dirname $0)/finder
+if [ ! -x "$finder" ]; then
+    finder=$(command -v finder)
+fi
+if [ -n "$finder" ] && [ -x "$finder" ]; then
+    exec "$finder" "$filesdir" "$searchstr"
+fi
+
+line_found=$( grep -r -- "$searchstr" "$filesdir" | wc -l)
+file_found=$( grep -rl -- "$searchstr" "$filesdir" | wc -l)
 echo "The number of files are ${file_found} and the number of matching lines are ${line_found}"
@@ -99,6 +99,7 @@ make ARCH=${ARCH} CROSS_COMPILE=${CROSS_COMPILE}
 # TODO: Copy the finder related scripts and executables to the /home directory
 # on the target rootfs
 cp writer ${ROOTFSDIR}/home
+cp finder ${ROOTFSDIR}/home
 cp finder.sh ${ROOTFSDIR}/home
 cp finder-test.sh ${ROOTFSDIR}/home
 cp autorun-qemu.sh ${ROOTFSDIR}/home
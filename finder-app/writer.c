@@ -1,34 +1,502 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
-int main(int argc, char **argv){
+#define USAGE "Usage: writer [options] [file] [string]\n" \
+    "       writer -n count [options] [file name with %d] [string]\n" \
+    "       writer -m [options] [string] < manifest of 'file' or 'file<TAB>string' lines\n" \
+    "Options: -w buffered|direct,falloc,atomic  -s none|each|end|<window size>\n" \
+    "         -S <file size>, the string repeated to fill it  -v report throughput"
 
-    openlog("writer",0,LOG_USER);
-    if(argc != 3){
-        syslog(LOG_ERR,"Invalid args %d!\n",argc);
-        return 1;
+#define MODE_DIRECT 0x1     // O_DIRECT from aligned buffers, the unaligned tail through the page cache
+#define MODE_FALLOC 0x2     // reserve the whole file with fallocate() first
+#define MODE_ATOMIC 0x4     // write a temporary file, fdatasync it and rename it over the target
+
+#define CHUNK_SIZE (1 << 20)
+#define DIRECT_ALIGN 4096
+
+typedef enum sync_policy{
+    SYNC_NONE,      // leave it to writeback
+    SYNC_EACH,      // fdatasync every file, fsync its directory
+    SYNC_END,       // one syncfs once every file is written
+    SYNC_WINDOW,    // stream out every window while writing, fdatasync every file
+} sync_policy;
+
+/**
+ * State shared by all the files of one run
+ */
+typedef struct batch{
+    unsigned mode;
+    sync_policy sync;
+    unsigned long long window;      // SYNC_WINDOW bytes
+    unsigned long long size;        // file size, 0 for one copy of the string
+    // aligned buffer holding the string repeated from chunk_phase on
+    char* chunk;
+    size_t chunk_len;
+    size_t chunk_phase;
+    const char* chunk_string;
+    // directory of the previous file, kept open so the next one is created relative to it
+    char* dir_path;
+    size_t dir_cap;
+    int dir_fd;
+    dev_t dev;
+    bool many_filesystems;
+    bool direct_unsupported;
+    long files;
+    long long bytes;
+} batch;
+
+static int leave_dir(batch* b){
+    int ret = 0;
+    if (b->dir_fd < 0){
+        return 0;
+    }
+    if (b->sync == SYNC_EACH && fsync(b->dir_fd) != 0){
+        syslog(LOG_ERR, "Cannot sync %s: %s", b->dir_path, strerror(errno));
+        ret = -1;
     }
+    close(b->dir_fd);
+    b->dir_fd = -1;
+    return ret;
+}
 
-    // get arguments
-    char* filepath = argv[1];
-    char* writestr = argv[2];
+/**
+ * Make @param dir, of length @param len, the directory new files are created in.
+ */
+static int enter_dir(batch* b, const char* dir, size_t len){
+    struct stat st;
+    char* grown;
 
-    FILE* fd = fopen(filepath, "w");
-    if (fd == NULL){
-        syslog(LOG_ERR,"%s\n", strerror(errno));
-        return 1;
+    if (b->dir_fd >= 0 && strlen(b->dir_path) == len && memcmp(b->dir_path, dir, len) == 0){
+        return 0;
+    }
+    if (leave_dir(b) != 0){
+        return -1;
+    }
+    if (len + 1 > b->dir_cap){
+        grown = realloc(b->dir_path, len + 1);
+        if (grown == NULL){
+            syslog(LOG_ERR, "Out of memory");
+            return -1;
+        }
+        b->dir_path = grown;
+        b->dir_cap = len + 1;
     }
+    memcpy(b->dir_path, dir, len);
+    b->dir_path[len] = '\0';
+    b->dir_fd = open(b->dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (b->dir_fd < 0){
+        syslog(LOG_ERR, "Cannot open directory %s: %s", b->dir_path, strerror(errno));
+        return -1;
+    }
+    if (fstat(b->dir_fd, &st) == 0){
+        if (b->files > 0 && st.st_dev != b->dev){
+            b->many_filesystems = true;
+        }
+        b->dev = st.st_dev;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const char* buf, size_t len, const char* filepath){
+    size_t done = 0;
+    ssize_t ret;
 
-    int ret = fwrite(writestr, sizeof(char), strlen(writestr), fd);
-    if ( ret != strlen(writestr)){
-        syslog(LOG_ERR,"Write failed!!");
-        fclose(fd);
-        return 1;
+    while (done < len){
+        ret = write(fd, buf + done, len - done);
+        if (ret < 0 && errno == EINTR){
+            continue;
+        }
+        if (ret <= 0){
+            syslog(LOG_ERR, "Write to %s failed: %s", filepath, ret < 0 ? strerror(errno) : "no progress");
+            return -1;
+        }
+        done += ret;
     }
-    syslog(LOG_DEBUG,"Writing %s to %s", writestr, filepath);
+    return 0;
+}
+
+/**
+ * Fill the chunk with @param writestr repeated, starting @param phase bytes into it.
+ */
+static void fill_chunk(batch* b, const char* writestr, size_t len, size_t phase){
+    size_t filled = len - phase;
 
-    fclose(fd);
+    // a whole number of copies keeps the phase of every chunk, O_DIRECT needs aligned ones
+    b->chunk_len = (b->mode & MODE_DIRECT) || len > CHUNK_SIZE ? CHUNK_SIZE : CHUNK_SIZE - CHUNK_SIZE % len;
+    if (filled > b->chunk_len){
+        filled = b->chunk_len;
+    }
+    memcpy(b->chunk, writestr + phase, filled);
+    if (filled < b->chunk_len){
+        size_t head = len - filled < b->chunk_len - filled ? len - filled : b->chunk_len - filled;
+        memcpy(b->chunk + filled, writestr, head);
+        filled += head;
+    }
+    while (filled < b->chunk_len){
+        size_t copy = filled < b->chunk_len - filled ? filled : b->chunk_len - filled;
+        memcpy(b->chunk + filled, b->chunk, copy);
+        filled += copy;
+    }
+    b->chunk_string = writestr;
+    b->chunk_phase = phase;
+}
+
+/**
+ * Write @param total bytes of @param writestr repeated to @param fd.
+ */
+static int write_payload(batch* b, int fd, const char* filepath, const char* writestr, size_t len,
+        unsigned long long total, bool direct){
+    unsigned long long off = 0;
+    unsigned long long window_start = 0;
+    unsigned long long prev_start = 0;
+    unsigned long long prev_len = 0;
+    size_t n;
+
+    if (!direct && total == len){
+        return write_all(fd, writestr, len, filepath);
+    }
+    b->chunk_string = NULL;
+    while (off < total){
+        if (b->chunk_string != writestr || b->chunk_phase != off % len){
+            fill_chunk(b, writestr, len, off % len);
+        }
+        n = total - off < b->chunk_len ? total - off : b->chunk_len;
+        if (direct && n % DIRECT_ALIGN != 0){
+            if (n > DIRECT_ALIGN){
+                n -= n % DIRECT_ALIGN;
+            } else {
+                // the tail goes through the page cache
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                direct = false;
+            }
+        }
+        if (write_all(fd, b->chunk, n, filepath) != 0){
+            return -1;
+        }
+        off += n;
+        if (b->sync == SYNC_WINDOW && off - window_start >= b->window){
+            // start writeback of this window, wait for the previous one and drop it from the cache
+            sync_file_range(fd, window_start, off - window_start, SYNC_FILE_RANGE_WRITE);
+            if (prev_len > 0){
+                sync_file_range(fd, prev_start, prev_len,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+                posix_fadvise(fd, prev_start, prev_len, POSIX_FADV_DONTNEED);
+            }
+            prev_start = window_start;
+            prev_len = off - window_start;
+            window_start = off;
+        }
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+static int open_target(batch* b, const char* filepath, const char* name, bool* direct){
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    int fd;
+
+    *direct = (b->mode & MODE_DIRECT) && !b->direct_unsupported;
+    fd = openat(b->dir_fd, name, flags | (*direct ? O_DIRECT : 0), 0666);
+    if (fd < 0 && *direct && errno == EINVAL){
+        // e.g. tmpfs, keep going through the page cache
+        syslog(LOG_WARNING, "O_DIRECT is not supported for %s, writing buffered", filepath);
+        b->direct_unsupported = true;
+        *direct = false;
+        fd = openat(b->dir_fd, name, flags, 0666);
+    }
+    if (fd < 0){
+        syslog(LOG_ERR, "Cannot create %s: %s", filepath, strerror(errno));
+    }
+    return fd;
+}
+
+static int write_file(batch* b, const char* filepath, const char* writestr, size_t len){
+    const char* slash = strrchr(filepath, '/');
+    const char* name = slash != NULL ? slash + 1 : filepath;
+    unsigned long long total = b->size > 0 && len > 0 ? b->size : len;
+    char* tmp = NULL;
+    bool direct;
+    int ret = -1;
+    int fd;
+
+    if (slash == filepath ? enter_dir(b, "/", 1) :
+            slash != NULL ? enter_dir(b, filepath, slash - filepath) : enter_dir(b, ".", 1)){
+        return -1;
+    }
+    if (b->mode & MODE_ATOMIC){
+        // in the same directory, so the rename cannot cross filesystems
+        tmp = malloc(strlen(name) + 32);
+        if (tmp == NULL){
+            syslog(LOG_ERR, "Out of memory");
+            return -1;
+        }
+        sprintf(tmp, ".%s.%d.tmp", name, (int) getpid());
+    }
+    fd = open_target(b, filepath, tmp != NULL ? tmp : name, &direct);
+    if (fd < 0){
+        free(tmp);
+        return -1;
+    }
+    if ((b->mode & MODE_FALLOC) && total > 0 && fallocate(fd, 0, 0, total) != 0 &&
+            errno != EOPNOTSUPP && errno != ENOSYS){
+        syslog(LOG_ERR, "Cannot allocate %llu bytes for %s: %s", total, filepath, strerror(errno));
+        goto out;
+    }
+    if (write_payload(b, fd, filepath, writestr, len, total, direct) != 0){
+        goto out;
+    }
+    // a rename must not expose a file whose data is not on disk yet
+    if ((b->sync == SYNC_EACH || b->sync == SYNC_WINDOW || tmp != NULL) && fdatasync(fd) != 0){
+        syslog(LOG_ERR, "Cannot sync %s: %s", filepath, strerror(errno));
+        goto out;
+    }
+    if (close(fd) != 0){
+        fd = -1;
+        syslog(LOG_ERR, "Cannot close %s: %s", filepath, strerror(errno));
+        goto out;
+    }
+    fd = -1;
+    if (tmp != NULL && renameat(b->dir_fd, tmp, b->dir_fd, name) != 0){
+        syslog(LOG_ERR, "Cannot rename into %s: %s", filepath, strerror(errno));
+        goto out;
+    }
+    b->files++;
+    b->bytes += total;
+    ret = 0;
+out:
+    if (fd >= 0){
+        close(fd);
+    }
+    if (ret != 0 && tmp != NULL){
+        unlinkat(b->dir_fd, tmp, 0);
+    }
+    free(tmp);
+    return ret;
+}
+
+static unsigned long long parse_size(const char* arg){
+    char* end;
+    unsigned long long size = strtoull(arg, &end, 10);
+
+    switch (*end){
+        case 'g': case 'G': size <<= 10; /* fall through */
+        case 'm': case 'M': size <<= 10; /* fall through */
+        case 'k': case 'K': size <<= 10; end++; break;
+        default: break;
+    }
+    return *end == '\0' ? size : 0;
+}
+
+static bool parse_mode(batch* b, char* arg){
+    char* save;
+
+    b->mode = 0;
+    for (char* tok = strtok_r(arg, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)){
+        if (strcmp(tok, "direct") == 0){
+            b->mode |= MODE_DIRECT;
+        } else if (strcmp(tok, "falloc") == 0){
+            b->mode |= MODE_FALLOC;
+        } else if (strcmp(tok, "atomic") == 0){
+            b->mode |= MODE_ATOMIC;
+        } else if (strcmp(tok, "buffered") != 0){
+            return false;
+        }
+    }
+    return true;
+}
+
+static int finish(batch* b){
+    int ret = 0;
+    if (b->sync == SYNC_END && b->dir_fd >= 0){
+        if (b->many_filesystems){
+            sync();
+        } else if (syncfs(b->dir_fd) != 0){
+            syslog(LOG_ERR, "Cannot sync %s: %s", b->dir_path, strerror(errno));
+            ret = -1;
+        }
+    }
+    if (leave_dir(b) != 0){
+        ret = -1;
+    }
+    free(b->dir_path);
+    free(b->chunk);
+    return ret;
+}
+
+/**
+ * Write files @param pattern with its %d replaced by 1 to @param count.
+ */
+static int write_numbered(batch* b, long count, const char* pattern, const char* writestr){
+    const char* mark = strstr(pattern, "%d");
+    size_t prefix_len;
+    size_t len = strlen(writestr);
+    char* path;
+    int ret = 0;
+
+    if (mark == NULL || strstr(mark + 2, "%d") != NULL){
+        syslog(LOG_ERR, "File name %s must hold %%d exactly once", pattern);
+        return -1;
+    }
+    prefix_len = mark - pattern;
+    // room for the longest number, reused for every name
+    path = malloc(strlen(pattern) + 21);
+    if (path == NULL){
+        syslog(LOG_ERR, "Out of memory");
+        return -1;
+    }
+    memcpy(path, pattern, prefix_len);
+    for (long i = 1; i <= count && ret == 0; i++){
+        sprintf(path + prefix_len, "%ld%s", i, mark + 2);
+        ret = write_file(b, path, writestr, len);
+    }
+    free(path);
+    return ret;
+}
+
+/**
+ * Write the files listed on stdin, with their own string after a tab or @param writestr.
+ */
+static int write_manifest(batch* b, const char* writestr){
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    char* tab;
+    int ret = 0;
+
+    while (ret == 0 && (len = getline(&line, &cap, stdin)) > 0){
+        if (line[len - 1] == '\n'){
+            line[--len] = '\0';
+        }
+        if (len == 0){
+            continue;
+        }
+        tab = strchr(line, '\t');
+        if (tab != NULL){
+            *tab = '\0';
+            ret = write_file(b, line, tab + 1, len - (tab + 1 - line));
+        } else if (writestr != NULL){
+            ret = write_file(b, line, writestr, strlen(writestr));
+        } else {
+            syslog(LOG_ERR, "No string for %s", line);
+            ret = -1;
+        }
+    }
+    free(line);
+    return ret;
+}
+
+int main(int argc, char **argv){
+    batch b = { .sync = SYNC_NONE, .dir_fd = -1 };
+    long count = 0;
+    bool manifest = false;
+    bool verbose = false;
+    struct timespec start, end;
+    double seconds;
+    int opt;
+    int ret;
+
+    openlog("writer",0,LOG_USER);
+    // + keeps a leading - in the string to write from being taken as an option
+    while ((opt = getopt(argc, argv, "+n:ms:w:S:v")) != -1){
+        switch (opt){
+            case 'n':
+                count = strtol(optarg, NULL, 10);
+                if (count < 1){
+                    syslog(LOG_ERR, "Invalid count %s", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                manifest = true;
+                break;
+            case 's':
+                if (strcmp(optarg, "none") == 0){
+                    b.sync = SYNC_NONE;
+                } else if (strcmp(optarg, "each") == 0){
+                    b.sync = SYNC_EACH;
+                } else if (strcmp(optarg, "end") == 0){
+                    b.sync = SYNC_END;
+                } else if ((b.window = parse_size(optarg)) > 0){
+                    b.sync = SYNC_WINDOW;
+                } else {
+                    syslog(LOG_ERR, "Invalid sync policy %s", optarg);
+                    return 1;
+                }
+                break;
+            case 'w':
+                if (!parse_mode(&b, optarg)){
+                    syslog(LOG_ERR, "Invalid write mode %s", optarg);
+                    return 1;
+                }
+                break;
+            case 'S':
+                b.size = parse_size(optarg);
+                if (b.size == 0){
+                    syslog(LOG_ERR, "Invalid size %s", optarg);
+                    return 1;
+                }
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                fprintf(stderr, "%s\n", USAGE);
+                return 1;
+        }
+    }
+    if (b.size > 0 || (b.mode & MODE_DIRECT)){
+        if (posix_memalign((void**) &b.chunk, DIRECT_ALIGN, CHUNK_SIZE) != 0){
+            syslog(LOG_ERR, "Out of memory");
+            return 1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (manifest){
+        if (count > 0 || argc - optind > 1){
+            syslog(LOG_ERR, "Invalid args %d!\n", argc);
+            return 1;
+        }
+        ret = write_manifest(&b, argc > optind ? argv[optind] : NULL);
+    } else if (count > 0){
+        if (argc - optind != 2){
+            syslog(LOG_ERR, "Invalid args %d!\n", argc);
+            return 1;
+        }
+        ret = write_numbered(&b, count, argv[optind], argv[optind + 1]);
+    } else {
+        if (argc - optind != 2){
+            syslog(LOG_ERR,"Invalid args %d!\n",argc);
+            return 1;
+        }
+        // get arguments
+        char* filepath = argv[optind];
+        char* writestr = argv[optind + 1];
+        ret = write_file(&b, filepath, writestr, strlen(writestr));
+        if (ret == 0){
+            syslog(LOG_DEBUG,"Writing %s to %s", writestr, filepath);
+        }
+    }
+    if (finish(&b) != 0){
+        ret = -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (count > 0 || manifest || verbose){
+        syslog(LOG_DEBUG, "Wrote %ld files, %lld bytes in %.3f s, %.1f MB/s", b.files, b.bytes, seconds,
+                b.bytes / 1e6 / (seconds > 0 ? seconds : 1e-9));
+    }
+    if (verbose){
+        printf("Wrote %ld files, %lld bytes in %.3f s, %.1f MB/s\n", b.files, b.bytes, seconds,
+                b.bytes / 1e6 / (seconds > 0 ? seconds : 1e-9));
+    }
+    return ret == 0 ? 0 : 1;
+}
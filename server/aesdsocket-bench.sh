@@ -0,0 +1,86 @@
+#!/bin/bash
+# Loopback load against aesdsocket, thread per client then the io_uring backend
+# Usage: aesdsocket-bench.sh [clients] [packets per client]
+# Each packet is its own connection and its reply, the whole history, is read to the end.
+# Run next to a built aesdsocket, with nothing else listening on port 9000 and a syslog
+# daemon running: without one every syslog() falls back to the console and dominates.
+
+set -e
+set -u
+
+CLIENTS=${1:-8}
+PACKETS=${2:-200}
+PORT=9000
+
+cd `dirname $0`
+if [ ! -x aesdsocket ]; then
+	echo "Build the server first with make"
+	exit 1
+fi
+
+now() {
+	date +%s.%N
+}
+
+elapsed() {
+	awk -v start="$1" -v end="$2" 'BEGIN { printf "%.3f", end - start }'
+}
+
+wait_listening() {
+	for i in $(seq 50); do
+		if (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null; then
+			return 0
+		fi
+		sleep 0.1
+	done
+	echo "Server did not start listening"
+	return 1
+}
+
+# the ring of an io_uring run releases the listening socket only after the process exits,
+# until then it still completes connections nobody will accept
+wait_closed() {
+	for i in $(seq 50); do
+		if ! (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null; then
+			return 0
+		fi
+		sleep 0.1
+	done
+	echo "Port ${PORT} still open"
+	return 1
+}
+
+client() {
+	for i in $(seq $PACKETS); do
+		exec 3<>/dev/tcp/127.0.0.1/$PORT
+		printf 'client %d packet %d\n' $1 $i >&3
+		# bash reads sockets a byte at a time, cat drains the reply in large reads
+		cat <&3 > /dev/null
+		exec 3<&-
+	done
+}
+
+run() {
+	local name=$1
+	shift
+	./aesdsocket "$@" &
+	server=$!
+	wait_listening
+	# the probe connection above stored nothing, start timing from an empty history
+	start=$(now)
+	for c in $(seq $CLIENTS); do
+		client $c &
+	done
+	wait $(jobs -p | grep -v "^$server\$")
+	secs=$(elapsed $start $(now))
+	kill -TERM $server
+	wait $server || true
+	wait_closed
+	total=$((CLIENTS * PACKETS))
+	echo "${name}: ${total} packets from ${CLIENTS} clients in ${secs}s," \
+		$(awk -v n=$total -v s=$secs 'BEGIN { printf "%.0f", n / s }') "packets/s"
+}
+
+run "thread per client"
+# falls back to threads when the kernel has no io_uring, see syslog
+run "io_uring" -u
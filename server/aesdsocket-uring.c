@@ -0,0 +1,830 @@
+/**
+ * @file aesdsocket-uring.c
+ * @brief io_uring backend for aesdsocket
+ *
+ * One thread drives every client. Per client the flow is:
+ *   RECV (linked to an idle LINK_TIMEOUT) until a newline is seen,
+ *   WRITE of the packet to the store, one client at a time so completions come in store order,
+ *   then SEND of the history cache, or when the cache is off (or after a SEEKTO)
+ *   a READ_FIXED of the store followed by SEND of each chunk linked to the READ_FIXED of the next one.
+ * The store, the sockets and the store handle each client replays from are fixed files,
+ * replay chunks live in registered buffers.
+ * The ring is driven through the raw syscalls so no liburing is needed.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/syslog.h>
+#include <sys/uio.h>
+#include "aesdsocket-uring.h"
+#include "lockprof.h"
+
+#if AESD_HAVE_IO_URING
+
+#define URING_ENTRIES 256
+#define REPLAY_CHUNK 1024
+#define PACKET_CHUNK 1024
+// registered buffers and client slots are both capped by UIO_MAXIOV
+#define URING_MAX_CONNECTIONS 1024
+
+// fixed file table layout, each client has its socket and its store handle side by side
+#define FIXED_STORE 0
+#define FIXED_SERVER 1
+#define FIXED_CLIENT(i) (2 + 2 * (i))
+#define FIXED_CLIENT_STORE(i) (3 + 2 * (i))
+#define FIXED_FILES(n) FIXED_CLIENT(n)
+
+enum uring_op {
+    OP_ACCEPT = 1,
+    OP_TIMER,
+    OP_RECV,
+    OP_TIMEOUT,
+    OP_COMMIT,
+    OP_READ,
+    OP_SEND,
+    OP_SIGNAL,
+    OP_HANDOFF,
+    OP_DRAIN,
+    OP_CANCEL,
+    OP_REPLY,
+    OP_PEER,
+};
+
+#define USER_DATA(op, idx) (((uint64_t)(op) << 32) | (uint32_t)(idx))
+#define USER_OP(data) ((int)((data) >> 32))
+#define USER_IDX(data) ((int)((data) & 0xffffffff))
+
+struct uring {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned to_submit;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ptr;
+    size_t sq_len;
+    void* cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+};
+
+struct uring_conn {
+    bool used;
+    bool failed;
+    int client_fd;
+    int file_fd;
+    int inflight;
+    char* packet;
+    size_t len;
+    size_t cap;
+    size_t send_len;
+    void* reply_ref;            // history the reply is sent from, NULL while replaying the store
+    const char* reply;
+    size_t reply_len;
+    size_t reply_off;
+    struct __kernel_timespec idle;
+};
+
+static const struct uring_backend_params* params;
+static struct uring ring;
+static struct uring_conn* conns;
+static int max_conns;
+static int active_conns;
+static int pending_commits;
+// clients waiting for their store write, only the head one has it in flight
+static int* commit_queue;
+static int commit_head;
+static int commit_count;
+static bool commit_busy;
+static bool timer_due;
+static bool accept_armed;
+static char* replay_buffers;
+static bool fixed_buffers;
+static struct sockaddr_storage accept_addr;
+static socklen_t accept_addr_len;
+static bool draining;
+static struct __kernel_timespec drain_ts;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p){
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags){
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args){
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_setup(struct uring* r, unsigned entries){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd < 0){
+        return -1;
+    }
+    // replay reads rely on the file position, sockets on internal polling
+    if (!(p.features & IORING_FEAT_RW_CUR_POS) || !(p.features & IORING_FEAT_FAST_POLL)){
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED){
+        int err = errno;
+        close(r->fd);
+        errno = err;
+        return -1;
+    }
+
+    r->sq_head = (unsigned*)((char*)r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned*)((char*)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned*)((char*)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)((char*)r->sq_ptr + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->sq_local_tail = *r->sq_tail;
+    r->cq_head = (unsigned*)((char*)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned*)((char*)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned*)((char*)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)((char*)r->cq_ptr + p.cq_off.cqes);
+    return 0;
+}
+
+static int uring_submit(struct uring* r, unsigned wait_nr){
+    int ret;
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    do {
+        ret = sys_io_uring_enter(r->fd, r->to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR && wait_nr == 0);
+    if (ret >= 0){
+        r->to_submit = (unsigned) ret >= r->to_submit ? 0 : r->to_submit - ret;
+    }
+    return ret;
+}
+
+static struct io_uring_sqe* uring_get_sqe(struct uring* r){
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_local_tail - head >= r->sq_entries){
+        // submission queue full, push it to the kernel before queueing more
+        uring_submit(r, 0);
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sq_local_tail - head >= r->sq_entries){
+            return NULL;
+        }
+    }
+    unsigned idx = r->sq_local_tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->sq_local_tail++;
+    r->to_submit++;
+    return sqe;
+}
+
+static void uring_teardown(struct uring* r){
+    munmap(r->sqes, r->sqes_len);
+    munmap(r->cq_ptr, r->cq_len);
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+}
+
+static void arm_accept(void){
+    if (draining || accept_armed || active_conns >= max_conns || pending_commits >= params->max_pending_commits){
+        return;
+    }
+    struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+    if (sqe == NULL){
+        return;
+    }
+    accept_addr_len = sizeof(accept_addr);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = FIXED_SERVER;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t) &accept_addr;
+    sqe->addr2 = (uint64_t)(uintptr_t) &accept_addr_len;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = USER_DATA(OP_ACCEPT, 0);
+    accept_armed = true;
+}
+
+static void arm_poll(int fd, int op){
+    if (fd < 0 || draining){
+        return;
+    }
+    struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+    if (sqe == NULL){
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll_events = POLLIN;
+    sqe->user_data = USER_DATA(op, 0);
+}
+
+static int update_fixed_file(int slot, int fd){
+    struct io_uring_files_update upd = {
+        .offset = slot,
+        .fds = (uint64_t)(uintptr_t) &fd,
+    };
+    return sys_io_uring_register(ring.fd, IORING_REGISTER_FILES_UPDATE, &upd, 1);
+}
+
+static void conn_release(int idx){
+    struct uring_conn* c = &conns[idx];
+    update_fixed_file(FIXED_CLIENT(idx), -1);
+    close(c->client_fd);
+    if (c->file_fd >= 0){
+        update_fixed_file(FIXED_CLIENT_STORE(idx), -1);
+        close(c->file_fd);
+    }
+    if (c->reply_ref != NULL){
+        params->put_history(c->reply_ref);
+    }
+    free(c->packet);
+    memset(c, 0, sizeof(*c));
+    active_conns--;
+    syslog(LOG_DEBUG, "uring: closed client slot %d", idx);
+    arm_accept();
+}
+
+/**
+ * Mark the connection as done and release it once its last request completed.
+ * Outstanding socket requests are woken up by shutting the socket down.
+ */
+static void conn_finish(int idx, bool failed){
+    struct uring_conn* c = &conns[idx];
+    if (!c->failed){
+        c->failed = true;
+        if (failed){
+            shutdown(c->client_fd, SHUT_RDWR);
+        }
+    }
+    if (c->inflight == 0){
+        conn_release(idx);
+    }
+}
+
+static void conn_post_recv(int idx){
+    struct uring_conn* c = &conns[idx];
+    if (c->len == c->cap){
+        if (c->cap >= params->max_packet_bytes){
+            syslog(LOG_DEBUG, "uring: packet in slot %d exceeds %zu bytes, dropping", idx, params->max_packet_bytes);
+            conn_finish(idx, true);
+            return;
+        }
+        size_t cap = c->cap + PACKET_CHUNK > params->max_packet_bytes ?
+            params->max_packet_bytes : c->cap * 2 + PACKET_CHUNK;
+        char* grown = realloc(c->packet, cap);
+        if (grown == NULL){
+            conn_finish(idx, true);
+            return;
+        }
+        c->packet = grown;
+        c->cap = cap;
+    }
+
+    // like SO_RCVTIMEO in the thread backend, an idle timeout of 0 means none
+    bool idle_timeout = params->idle_timeout > 0;
+    struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+    struct io_uring_sqe* tsqe = idle_timeout && sqe != NULL ? uring_get_sqe(&ring) : NULL;
+    if (sqe == NULL || (idle_timeout && tsqe == NULL)){
+        // an unfinished pair must still be valid, turn it into nops
+        if (sqe) { sqe->opcode = IORING_OP_NOP; sqe->user_data = USER_DATA(OP_TIMEOUT, idx); c->inflight++; }
+        conn_finish(idx, true);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = FIXED_CLIENT(idx);
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)(c->packet + c->len);
+    sqe->len = c->cap - c->len;
+    sqe->user_data = USER_DATA(OP_RECV, idx);
+    c->inflight++;
+    if (!idle_timeout){
+        return;
+    }
+
+    sqe->flags |= IOSQE_IO_LINK;
+    c->idle.tv_sec = params->idle_timeout;
+    c->idle.tv_nsec = 0;
+    tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+    tsqe->addr = (uint64_t)(uintptr_t) &c->idle;
+    tsqe->len = 1;
+    tsqe->user_data = USER_DATA(OP_TIMEOUT, idx);
+    c->inflight++;
+}
+
+/**
+ * Make the store handle of the client in slot @param idx, once opened, usable by replay reads.
+ * @return false if it could not be registered
+ */
+static bool conn_register_store(int idx){
+    if (update_fixed_file(FIXED_CLIENT_STORE(idx), conns[idx].file_fd) < 0){
+        syslog(LOG_DEBUG, "uring: unable to register the store of slot %d: %s", idx, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static void prep_read(struct io_uring_sqe* sqe, int idx){
+    sqe->fd = FIXED_CLIENT_STORE(idx);
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)(replay_buffers + (size_t) idx * REPLAY_CHUNK);
+    sqe->len = REPLAY_CHUNK;
+    // -1 reads from the file position, so a SEEKTO done on file_fd is honoured
+    sqe->off = (uint64_t) -1;
+    if (fixed_buffers){
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = idx;
+    }else{
+        sqe->opcode = IORING_OP_READ;
+    }
+    sqe->user_data = USER_DATA(OP_READ, idx);
+}
+
+static void conn_post_read(int idx){
+    struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+    if (sqe == NULL){
+        conn_finish(idx, true);
+        return;
+    }
+    prep_read(sqe, idx);
+    conns[idx].inflight++;
+}
+
+/**
+ * Start the store write of the next queued client unless one is in flight.
+ */
+static void commit_next(void){
+    while (!commit_busy && commit_count > 0){
+        int idx = commit_queue[commit_head];
+        struct uring_conn* c = &conns[idx];
+        commit_head = (commit_head + 1) % max_conns;
+        commit_count--;
+        // the queue slot held the connection open
+        c->inflight--;
+
+        struct io_uring_sqe* sqe = c->failed ? NULL : uring_get_sqe(&ring);
+        if (sqe == NULL){
+            pending_commits--;
+            conn_finish(idx, true);
+            continue;
+        }
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = FIXED_STORE;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->addr = (uint64_t)(uintptr_t) c->packet;
+        sqe->len = c->len;
+        sqe->off = (uint64_t) -1;
+        sqe->user_data = USER_DATA(OP_COMMIT, idx);
+        c->inflight++;
+        commit_busy = true;
+    }
+}
+
+/**
+ * Queue the packet for the store. Writes go one at a time, concurrent ones could land
+ * in the store in another order than they complete and the history cache follows completions.
+ */
+static void conn_post_commit(int idx){
+    commit_queue[(commit_head + commit_count) % max_conns] = idx;
+    commit_count++;
+    conns[idx].inflight++;
+    pending_commits++;
+    commit_next();
+}
+
+static void conn_post_reply(int idx){
+    struct uring_conn* c = &conns[idx];
+    struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+    if (sqe == NULL){
+        conn_finish(idx, true);
+        return;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = FIXED_CLIENT(idx);
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t)(uintptr_t)(c->reply + c->reply_off);
+    sqe->len = c->reply_len - c->reply_off;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = USER_DATA(OP_REPLY, idx);
+    c->inflight++;
+}
+
+/**
+ * A plain reply is the whole history, send it from the cache when it is on.
+ */
+static void conn_start_reply(int idx){
+    struct uring_conn* c = &conns[idx];
+    if (params->get_history == NULL ||
+            !params->get_history(&c->reply_ref, &c->reply, &c->reply_len)){
+        c->reply_ref = NULL;
+        c->file_fd = open(params->store_path, O_RDONLY | O_CLOEXEC);
+        if (c->file_fd < 0){
+            syslog(LOG_DEBUG, "uring: unable to open the store for slot %d: %s", idx, strerror(errno));
+            conn_finish(idx, true);
+            return;
+        }
+        if (!conn_register_store(idx)){
+            conn_finish(idx, true);
+            return;
+        }
+        conn_post_read(idx);
+        return;
+    }
+    c->reply_off = 0;
+    if (c->reply_len == 0){
+        conn_finish(idx, false);
+        return;
+    }
+    conn_post_reply(idx);
+}
+
+static void conn_post_send(int idx){
+    struct uring_conn* c = &conns[idx];
+    struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+    struct io_uring_sqe* rsqe = uring_get_sqe(&ring);
+    if (sqe == NULL || rsqe == NULL){
+        if (sqe) { sqe->opcode = IORING_OP_NOP; sqe->user_data = USER_DATA(OP_TIMEOUT, idx); c->inflight++; }
+        conn_finish(idx, true);
+        return;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = FIXED_CLIENT(idx);
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->addr = (uint64_t)(uintptr_t)(replay_buffers + (size_t) idx * REPLAY_CHUNK);
+    sqe->len = c->send_len;
+    // a short send breaks the link, so the next chunk never overwrites unsent data
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = USER_DATA(OP_SEND, idx);
+
+    prep_read(rsqe, idx);
+    c->inflight += 2;
+}
+
+/**
+ * Stop taking clients and give the ones in flight drain_timeout seconds.
+ */
+static void start_drain(void){
+    if (draining){
+        return;
+    }
+    syslog(LOG_DEBUG, "uring: draining %d clients", active_conns);
+    draining = true;
+
+    struct io_uring_sqe* sqe;
+    if (accept_armed && (sqe = uring_get_sqe(&ring)) != NULL){
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = USER_DATA(OP_ACCEPT, 0);
+        sqe->user_data = USER_DATA(OP_CANCEL, 0);
+    }
+    if ((sqe = uring_get_sqe(&ring)) != NULL){
+        drain_ts.tv_sec = params->drain_timeout;
+        drain_ts.tv_nsec = 0;
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (uint64_t)(uintptr_t) &drain_ts;
+        sqe->len = 1;
+        sqe->user_data = USER_DATA(OP_DRAIN, 0);
+    }
+}
+
+static void handle_drain_timeout(void){
+    syslog(LOG_DEBUG, "uring: drain timeout, closing %d clients", active_conns);
+    for (int i = 0; i < max_conns; i++){
+        if (conns[i].used){
+            conn_finish(i, true);
+        }
+    }
+}
+
+static void handle_accept(int res){
+    accept_armed = false;
+    if (res >= 0 && draining){
+        close(res);
+        return;
+    }
+    if (res < 0){
+        syslog(LOG_DEBUG, "uring: accept failed: %s", strerror(-res));
+        arm_accept();
+        return;
+    }
+
+    int idx;
+    for (idx = 0; idx < max_conns && conns[idx].used; idx++)
+        ;
+    // arm_accept only runs with a free slot, this is just defensive
+    if (idx == max_conns){
+        close(res);
+        return;
+    }
+
+    struct uring_conn* c = &conns[idx];
+    memset(c, 0, sizeof(*c));
+    c->used = true;
+    c->client_fd = res;
+    // a private handle on the store is only needed for a SEEKTO or a cache miss, opening one
+    // per client would also keep the driver off its lock-free path
+    c->file_fd = -1;
+    active_conns++;
+    if (update_fixed_file(FIXED_CLIENT(idx), res) < 0){
+        syslog(LOG_DEBUG, "uring: unable to set up client slot %d: %s", idx, strerror(errno));
+        conn_finish(idx, true);
+        arm_accept();
+        return;
+    }
+    syslog(LOG_DEBUG, "uring: accepted client in slot %d", idx);
+    conn_post_recv(idx);
+    arm_accept();
+}
+
+static void handle_recv(int idx, int res){
+    struct uring_conn* c = &conns[idx];
+    if (c->failed || res <= 0){
+        // -ECANCELED here means the idle timeout fired
+        conn_finish(idx, res != 0);
+        return;
+    }
+    char* nl = memchr(c->packet + c->len, '\n', res);
+    c->len += res;
+    if (nl == NULL){
+        conn_post_recv(idx);
+        return;
+    }
+    if (params->handle_command != NULL && params->handle_command(&c->file_fd, c->packet, c->len)){
+        if (c->file_fd < 0 || !conn_register_store(idx)){
+            conn_finish(idx, true);
+            return;
+        }
+        conn_post_read(idx);
+        return;
+    }
+    conn_post_commit(idx);
+}
+
+static void handle_commit(int idx, int res){
+    struct uring_conn* c = &conns[idx];
+    pending_commits--;
+    commit_busy = false;
+    if (res < 0 || (size_t) res != c->len){
+        syslog(LOG_DEBUG, "uring: store write failed in slot %d: %s", idx, res < 0 ? strerror(-res) : "short write");
+        c->failed = true;
+    }else{
+        if (params->on_commit != NULL){
+            params->on_commit(c->packet, c->len);
+        }
+        if (!c->failed){
+            conn_start_reply(idx);
+        }
+    }
+    // the timestamp writes to the store directly, so it waits for the queue to be idle
+    if (timer_due){
+        timer_due = false;
+        params->on_timer(params->timer_fd);
+        arm_poll(params->timer_fd, OP_TIMER);
+    }
+    commit_next();
+    arm_accept();
+}
+
+static void handle_read(int idx, int res){
+    struct uring_conn* c = &conns[idx];
+    if (c->failed || res <= 0){
+        // end of the store (or an error / a broken link): the replay is over
+        conn_finish(idx, res < 0);
+        return;
+    }
+    c->send_len = res;
+    conn_post_send(idx);
+}
+
+static void handle_send(int idx, int res){
+    struct uring_conn* c = &conns[idx];
+    if (res < 0 || (size_t) res != c->send_len){
+        c->failed = true;
+    }
+}
+
+static void handle_reply(int idx, int res){
+    struct uring_conn* c = &conns[idx];
+    if (c->failed || res <= 0){
+        conn_finish(idx, true);
+        return;
+    }
+    c->reply_off += res;
+    if (c->reply_off < c->reply_len){
+        conn_post_reply(idx);
+        return;
+    }
+    conn_finish(idx, false);
+}
+
+static void handle_cqe(const struct io_uring_cqe* cqe){
+    int op = USER_OP(cqe->user_data);
+    int idx = USER_IDX(cqe->user_data);
+    struct io_uring_sqe* sqe_rearm;
+
+    switch (op){
+        case OP_ACCEPT:
+            handle_accept(cqe->res);
+            return;
+        case OP_TIMER:
+            if (cqe->res > 0 && params->on_timer != NULL && commit_busy){
+                // handle_commit() runs it and re-arms the poll
+                timer_due = true;
+                return;
+            }
+            if (cqe->res > 0 && params->on_timer != NULL){
+                params->on_timer(params->timer_fd);
+            }
+            arm_poll(params->timer_fd, OP_TIMER);
+            return;
+        case OP_SIGNAL:
+            if (cqe->res > 0){
+                struct signalfd_siginfo info;
+                ssize_t got = read(params->signal_fd, &info, sizeof(info));
+                if (got == sizeof(info) && info.ssi_signo == SIGUSR1){
+                    lockprof_dump();
+                }
+                else if (got == sizeof(info)){
+                    syslog(LOG_DEBUG, "uring: caught signal %u", info.ssi_signo);
+                    // a second signal while draining cuts the drain short
+                    if (draining){
+                        handle_drain_timeout();
+                    }
+                    start_drain();
+                }
+            }
+            // keep watching so a second signal can force the exit
+            if (params->signal_fd >= 0 && (sqe_rearm = uring_get_sqe(&ring)) != NULL){
+                sqe_rearm->opcode = IORING_OP_POLL_ADD;
+                sqe_rearm->fd = params->signal_fd;
+                sqe_rearm->poll_events = POLLIN;
+                sqe_rearm->user_data = USER_DATA(OP_SIGNAL, 0);
+            }
+            return;
+        case OP_HANDOFF:
+            if (cqe->res > 0 && params->on_handoff != NULL && params->on_handoff(params->handoff_fd)){
+                start_drain();
+            }
+            arm_poll(params->handoff_fd, OP_HANDOFF);
+            return;
+        case OP_PEER:
+            if (params->on_peer_exit != NULL){
+                params->on_peer_exit();
+            }
+            return;
+        case OP_DRAIN:
+            if (active_conns > 0){
+                handle_drain_timeout();
+            }
+            return;
+        case OP_CANCEL:
+            return;
+    }
+
+    if (idx < 0 || idx >= max_conns || !conns[idx].used){
+        return;
+    }
+    conns[idx].inflight--;
+    switch (op){
+        case OP_RECV:
+            handle_recv(idx, cqe->res);
+            break;
+        case OP_COMMIT:
+            handle_commit(idx, cqe->res);
+            break;
+        case OP_READ:
+            handle_read(idx, cqe->res);
+            break;
+        case OP_SEND:
+            handle_send(idx, cqe->res);
+            break;
+        case OP_REPLY:
+            handle_reply(idx, cqe->res);
+            break;
+        default:
+            break;
+    }
+    // a failed request may have been the last one outstanding
+    if (conns[idx].used && conns[idx].failed && conns[idx].inflight == 0){
+        conn_release(idx);
+    }
+}
+
+int uring_backend_run(const struct uring_backend_params* p){
+    params = p;
+    max_conns = p->max_connections;
+    if (max_conns > URING_MAX_CONNECTIONS){
+        max_conns = URING_MAX_CONNECTIONS;
+    }
+
+    if (uring_setup(&ring, URING_ENTRIES) < 0){
+        return -1;
+    }
+
+    conns = calloc(max_conns, sizeof(*conns));
+    commit_queue = calloc(max_conns, sizeof(*commit_queue));
+    int* files = malloc(sizeof(int) * FIXED_FILES(max_conns));
+    replay_buffers = aligned_alloc(4096, (size_t) max_conns * REPLAY_CHUNK);
+    struct iovec* iovs = calloc(max_conns, sizeof(*iovs));
+    if (conns == NULL || commit_queue == NULL || files == NULL || replay_buffers == NULL || iovs == NULL){
+        free(conns);
+        free(commit_queue);
+        free(files);
+        free(replay_buffers);
+        free(iovs);
+        uring_teardown(&ring);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    files[FIXED_STORE] = p->store_fd;
+    files[FIXED_SERVER] = p->server_fd;
+    for (int i = 0; i < max_conns; i++){
+        files[FIXED_CLIENT(i)] = -1;
+        files[FIXED_CLIENT_STORE(i)] = -1;
+    }
+    if (sys_io_uring_register(ring.fd, IORING_REGISTER_FILES, files, FIXED_FILES(max_conns)) < 0){
+        int err = errno;
+        free(conns);
+        free(commit_queue);
+        free(files);
+        free(replay_buffers);
+        free(iovs);
+        uring_teardown(&ring);
+        errno = err;
+        return -1;
+    }
+    free(files);
+
+    // registering pins memory, older kernels charge it to RLIMIT_MEMLOCK
+    for (int i = 0; i < max_conns; i++){
+        iovs[i].iov_base = replay_buffers + (size_t) i * REPLAY_CHUNK;
+        iovs[i].iov_len = REPLAY_CHUNK;
+    }
+    fixed_buffers = sys_io_uring_register(ring.fd, IORING_REGISTER_BUFFERS, iovs, max_conns) == 0;
+    free(iovs);
+    if (!fixed_buffers){
+        syslog(LOG_DEBUG, "uring: buffer registration failed (%s), using plain reads", strerror(errno));
+    }
+
+    syslog(LOG_DEBUG, "uring: serving up to %d clients", max_conns);
+    arm_accept();
+    arm_poll(p->timer_fd, OP_TIMER);
+    arm_poll(p->signal_fd, OP_SIGNAL);
+    arm_poll(p->handoff_fd, OP_HANDOFF);
+    arm_poll(p->handoff_peer_fd, OP_PEER);
+
+    while (!draining || active_conns > 0){
+        if (uring_submit(&ring, 1) < 0 && errno != EINTR && errno != EBUSY){
+            syslog(LOG_DEBUG, "uring: enter failed: %s", strerror(errno));
+            return -1;
+        }
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail){
+            handle_cqe(&ring.cqes[head & *ring.cq_mask]);
+            head++;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    uring_teardown(&ring);
+    return 0;
+}
+
+#else /* !AESD_HAVE_IO_URING */
+
+int uring_backend_run(const struct uring_backend_params* p){
+    (void) p;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif /* AESD_HAVE_IO_URING */
@@ -0,0 +1,76 @@
+/*
+ * aesdsocket-uring.h
+ *
+ *  @brief Optional io_uring backend for aesdsocket
+ */
+
+#ifndef AESDSOCKET_URING_H
+#define AESDSOCKET_URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// the backend needs accept/recv/send ops, which arrived with IORING_FEAT_FAST_POLL
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_FAST_POLL
+#define AESD_HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifndef AESD_HAVE_IO_URING
+#define AESD_HAVE_IO_URING 0
+#endif
+
+/**
+ * Everything the io_uring backend borrows from the main server
+ */
+struct uring_backend_params {
+    int server_fd;              // listening socket, already bound and listening
+    int store_fd;               // shared append handle of the data store
+    const char* store_path;     // opened per client, only for a SEEKTO or a replay without the cache
+    int max_connections;
+    size_t max_packet_bytes;
+    int idle_timeout;
+    int max_pending_commits;
+    int timer_fd;               // timestamp timer, -1 when disabled
+    void (*on_timer)(int timer_fd);
+    /**
+     * Called with a complete packet before it is committed. A command opens @param file_fd
+     * on the store if it is -1, the reply is then read from it.
+     * @return true if the packet was a command and must not be stored
+     */
+    bool (*handle_command)(int* file_fd, char* packet, size_t len);
+    /**
+     * Called with each packet once it is in the store, in store order.
+     */
+    void (*on_commit)(const char* packet, size_t len);
+    /**
+     * Take a reference on the cached history for a plain reply, released with put_history.
+     * @return false if the cache is off and the reply must be read from the store
+     */
+    bool (*get_history)(void** ref, const char** data, size_t* len);
+    void (*put_history)(void* ref);
+    int signal_fd;              // signalfd of the stop signals, starts the drain
+    int handoff_fd;             // hot restart listener, -1 when disabled
+    /**
+     * Pass the listening socket on to the instance connecting on @param handoff_fd.
+     * @return true if it was handed over and this instance should drain
+     */
+    bool (*on_handoff)(int handoff_fd);
+    int handoff_peer_fd;        // connection to the previous instance, hangs up once it exited, -1 when none
+    void (*on_peer_exit)(void);
+    int drain_timeout;          // seconds in-flight clients get once draining
+};
+
+/**
+ * Serve clients from a single thread through io_uring until a stop signal or a
+ * hot restart handoff, then drain in-flight clients for at most drain_timeout seconds.
+ * @return 0 once drained, -1 with errno set if io_uring could not be set up,
+ *      in which case the caller should fall back to the thread-per-client loop
+ */
+int uring_backend_run(const struct uring_backend_params* params);
+
+#endif /* AESDSOCKET_URING_H */
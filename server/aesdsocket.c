@@ -12,9 +12,18 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
 #include "freebsd/queue.h"
+#include "aesdsocket-uring.h"
+#include "lockprof.h"
 #include "../aesd-char-driver/aesd_ioctl.h"
 
 #define BUFF_SIZE 1024
@@ -24,11 +33,39 @@
 #else
 #define DATA_FILE "/var/tmp/aesdsocketdata"
 #endif
+#if USE_AESD_CHAR_DEVICE
+// the driver keeps its own history, timestamps are off unless asked for
+#define DEFAULT_TIMESTAMP_INTERVAL 0
+#else
+#define DEFAULT_TIMESTAMP_INTERVAL 10
+#endif
+#define DEFAULT_TIMESTAMP_FORMAT "%a, %d %b %Y %T %z"
+#define DEFAULT_MAX_CONNECTIONS 64
+#define DEFAULT_MAX_PACKET_BYTES (1024 * 1024)
+#define DEFAULT_IDLE_TIMEOUT 30
+#define DEFAULT_MAX_PENDING_COMMITS 16
+// how often a paused accept loop re-checks the limits
+#define BACKPRESSURE_POLL_MS 50
+#define DEFAULT_DRAIN_TIMEOUT 5
+
+typedef struct server_config{
+    int timestamp_interval;         // seconds between timestamps, 0 disables
+    const char* timestamp_format;   // strftime format of the timestamp record
+    int max_connections;            // clients served at once, accept pauses above it
+    size_t max_packet_bytes;        // largest packet accepted from one client
+    int idle_timeout;               // seconds a client may stay silent or unread
+    int max_pending_commits;        // commit queue depth that pauses accept
+    bool use_io_uring;              // serve from the io_uring backend when available
+    int drain_timeout;              // seconds in-flight clients get at shutdown
+    const char* handoff_path;       // unix socket used to pass the listener on hot restart
+} server_config;
+
 typedef struct client_thread_data{
     pthread_t tid;
     int client_fd;
     int file_fd;
     char client_ip[INET6_ADDRSTRLEN];
+    char* packet;
     bool completed;
 } client_thread_data;
 
@@ -39,43 +76,480 @@ typedef struct thread_entry{
 
 SLIST_HEAD(slisthead, thread_entry);
 
+/**
+ * Reference counted copy of the store contents, shared by every reply.
+ * Bytes below the published history_len never change, so commits can keep
+ * appending in place while older snapshots are still being sent.
+ */
+typedef struct history_buf{
+    atomic_int refs;
+    size_t cap;
+    char data[];
+} history_buf;
+
 static int server_fd;
+static int store_fd = -1;
+static int timer_fd = -1;
+static int signal_fd = -1;
+static int done_fd = -1;
+static int handoff_fd = -1;
+static int handoff_peer_fd = -1;
 static pthread_mutex_t fd_lock; 
 static struct slisthead head;
-//static pthread_t timestamp_thread_id;
+static server_config config = {
+    .timestamp_interval = DEFAULT_TIMESTAMP_INTERVAL,
+    .timestamp_format = DEFAULT_TIMESTAMP_FORMAT,
+    .max_connections = DEFAULT_MAX_CONNECTIONS,
+    .max_packet_bytes = DEFAULT_MAX_PACKET_BYTES,
+    .idle_timeout = DEFAULT_IDLE_TIMEOUT,
+    .max_pending_commits = DEFAULT_MAX_PENDING_COMMITS,
+    .drain_timeout = DEFAULT_DRAIN_TIMEOUT,
+};
+static atomic_int active_connections;
+static atomic_int pending_commits;
+// history_len and the history pointer change under history_lock, the contents under fd_lock
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+static history_buf* history;
+static size_t history_len;
+static bool history_valid = true;
+#if USE_AESD_CHAR_DEVICE
+static int history_fd = -1;
+#endif
+
+static void history_put(history_buf* buf){
+    if (buf != NULL && atomic_fetch_sub(&buf->refs, 1) == 1){
+        free(buf);
+    }
+}
 
-static void* timestamp_thread_func(void* thread_args){
+/**
+ * Take a reference on the current history.
+ * @return false if the cache is not usable and the reply must be read from the store
+ */
+static bool history_get(history_buf** buf, size_t* len){
+    lockprof_mutex_lock(&history_lock);
+    bool valid = history_valid;
+    *buf = history;
+    *len = history_len;
+    if (valid && *buf != NULL){
+        atomic_fetch_add(&(*buf)->refs, 1);
+    }
+    lockprof_mutex_unlock(&history_lock);
+    return valid;
+}
 
-    int fd;
-    time_t t;
-    struct tm* t_local;
-    char time_str[200];
-    char log_str[211];
+static void history_publish(history_buf* buf, size_t len, bool valid){
+    lockprof_mutex_lock(&history_lock);
+    history_buf* old = history;
+    history = buf;
+    history_len = len;
+    history_valid = valid;
+    lockprof_mutex_unlock(&history_lock);
+    if (old != buf){
+        history_put(old);
+    }
+}
+
+static history_buf* history_alloc(size_t cap){
+    history_buf* buf = malloc(sizeof(history_buf) + cap);
+    if (buf != NULL){
+        atomic_init(&buf->refs, 1);
+        buf->cap = cap;
+    }
+    return buf;
+}
+
+/**
+ * Append @param len bytes of @param buf to the cache, past what readers were handed.
+ * Caller must hold fd_lock.
+ * @return false if the cache had to be disabled
+ */
+static bool history_append(const char* buf, size_t len){
+    size_t need = history_len + len;
+    if (history == NULL || need > history->cap){
+        size_t cap = history != NULL ? history->cap : BUFF_SIZE;
+        while (cap < need){
+            cap *= 2;
+        }
+        history_buf* grown = history_alloc(cap);
+        if (grown == NULL){
+            syslog(LOG_DEBUG, "History cache disabled, out of memory");
+            history_publish(NULL, 0, false);
+            return false;
+        }
+        if (history != NULL){
+            memcpy(grown->data, history->data, history_len);
+        }
+        history_publish(grown, history_len, true);
+    }
+    memcpy(history->data + history_len, buf, len);
+    history_publish(history, need, true);
+    return true;
+}
+
+#if USE_AESD_CHAR_DEVICE
+// what the cache mirrors of the driver, protected by fd_lock
+static bool history_has_seqs;       // the store answers AESDCHAR_IOCSEEKSEQ
+static bool history_contiguous;     // the cached records have consecutive seqs
+static uint64_t history_oldest_seq;
+static uint64_t history_next_seq;
+static bool history_stale;          // waiting for history_refresh()
+static bool history_refreshing;
+static uint64_t history_gen;        // commits so far, a re-read is only kept if none came meanwhile
+
+static size_t count_lines(const char* buf, size_t len){
+    size_t lines = 0;
+    const char* end = buf + len;
+    while ((buf = memchr(buf, '\n', end - buf)) != NULL){
+        lines++;
+        buf++;
+    }
+    return lines;
+}
+
+/**
+ * Ask the driver which seqs it holds. Moves the position of history_fd, which is only read with pread.
+ * @return false if the store does not track seqs, as a plain file standing in for the device
+ */
+static bool history_bounds(struct aesd_seekseq* bounds){
+    memset(bounds, 0, sizeof(*bounds));
+    // the bounds are filled in also when seq 0 is long evicted
+    return ioctl(history_fd, AESDCHAR_IOCSEEKSEQ, bounds) == 0 || errno == ERANGE;
+}
 
-    while(true){
+/**
+ * Read the whole store, with the seqs it held. Needs no lock.
+ * @return the new buffer, NULL on failure
+ */
+static history_buf* history_read(size_t* len, struct aesd_seekseq* bounds, bool* has_seqs){
+    size_t used = 0;
+    ssize_t ret;
+    history_buf* fresh = history_alloc(BUFF_SIZE);
+
+    *has_seqs = history_bounds(bounds);
+    while (fresh != NULL){
+        if (used == fresh->cap){
+            history_buf* grown = realloc(fresh, sizeof(history_buf) + fresh->cap * 2);
+            if (grown == NULL){
+                break;
+            }
+            fresh = grown;
+            fresh->cap *= 2;
+        }
+        ret = pread(history_fd, fresh->data + used, fresh->cap - used, used);
+        if (ret < 0 && errno == EINTR){
+            continue;
+        }
+        if (ret < 0){
+            break;
+        }
+        if (ret == 0){
+            *len = used;
+            return fresh;
+        }
+        used += ret;
+    }
+    free(fresh);
+    return NULL;
+}
+
+/**
+ * Start caching @param fresh, read while the driver held @param bounds.
+ * Caller must hold fd_lock.
+ */
+static void history_adopt(history_buf* fresh, size_t len, const struct aesd_seekseq* bounds, bool has_seqs){
+    history_has_seqs = has_seqs;
+    history_oldest_seq = bounds->oldest_seq;
+    history_next_seq = bounds->next_seq;
+    // records the driver dropped while restoring its history leave gaps in the seqs,
+    // evictions cannot be mirrored line by line until those records are gone
+    history_contiguous = has_seqs && bounds->next_seq - bounds->oldest_seq == count_lines(fresh->data, len);
+    history_stale = false;
+    history_publish(fresh, len, true);
+}
+
+/**
+ * Leave the cache to history_refresh(), replies are read from the store meanwhile.
+ * Caller must hold fd_lock.
+ */
+static void history_mark_stale(void){
+    history_stale = true;
+    history_publish(NULL, 0, false);
+}
+
+/**
+ * Drop the @param records oldest records the driver evicted.
+ * Caller must hold fd_lock.
+ */
+static void history_drop(uint64_t records){
+    const char* start = history->data;
+    const char* end = history->data + history_len;
+    for (uint64_t i = 0; i < records && start != NULL; i++){
+        start = memchr(start, '\n', end - start);
+        start = start != NULL ? start + 1 : NULL;
+    }
+    if (start == NULL){
+        history_mark_stale();
+        return;
+    }
+    // readers may still be sending the current buffer, the rest goes to a new one
+    size_t len = end - start;
+    history_buf* fresh = history_alloc(history->cap);
+    if (fresh == NULL){
+        history_mark_stale();
+        return;
+    }
+    memcpy(fresh->data, start, len);
+    history_publish(fresh, len, true);
+}
+
+/**
+ * The driver commits one record per newline and evicts old ones on its own. Follow it from the
+ * seqs it reports: new records are appended, evicted ones dropped from the front, without
+ * reading the store back. Anything else, another writer, a partial record or seq gaps,
+ * leaves the cache to be read again outside fd_lock.
+ * Caller must hold fd_lock.
+ */
+static void history_update(const char* buf, size_t len){
+    struct aesd_seekseq bounds;
+
+    history_gen++;
+    if (!history_valid){
+        return;
+    }
+    if (!history_has_seqs){
+        // no driver behind DATA_FILE, it is append only
+        history_append(buf, len);
+        return;
+    }
+    if (len == 0 || buf[len - 1] != '\n' || !history_bounds(&bounds) ||
+            bounds.next_seq != history_next_seq + count_lines(buf, len) ||
+            (bounds.oldest_seq != history_oldest_seq && !history_contiguous)){
+        history_mark_stale();
+        return;
+    }
+    if (!history_append(buf, len)){
+        return;
+    }
+    history_next_seq = bounds.next_seq;
+    if (bounds.oldest_seq != history_oldest_seq){
+        history_drop(bounds.oldest_seq - history_oldest_seq);
+        history_oldest_seq = bounds.oldest_seq;
+    }
+}
 
-        // set cancellation as deferred
-        pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED,NULL);
+/**
+ * Read a stale cache back from the store without holding fd_lock, so commits are not held
+ * up by it. Call after releasing fd_lock.
+ */
+static void history_refresh(void){
+    struct aesd_seekseq bounds;
+    bool has_seqs;
+    size_t len = 0;
+
+    lockprof_mutex_lock(&fd_lock);
+    bool refresh = history_stale && !history_refreshing;
+    uint64_t gen = history_gen;
+    history_refreshing |= refresh;
+    lockprof_mutex_unlock(&fd_lock);
+    if (!refresh){
+        return;
+    }
 
-        //sleep as specification
-        sleep(10);
+    history_buf* fresh = history_read(&len, &bounds, &has_seqs);
 
-        // disable cancelation during lock period and file write
-        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    lockprof_mutex_lock(&fd_lock);
+    history_refreshing = false;
+    if (fresh == NULL){
+        syslog(LOG_DEBUG, "History re-read failed: %s", strerror(errno));
+    }else if (history_stale && history_gen == gen){
+        history_adopt(fresh, len, &bounds, has_seqs);
+        fresh = NULL;
+    }
+    lockprof_mutex_unlock(&fd_lock);
+    // a commit raced with the read, the next one tries again
+    free(fresh);
+}
+#else
+/**
+ * The store is append only, so the history grows by exactly what was written.
+ * Caller must hold fd_lock.
+ */
+static void history_update(const char* buf, size_t len){
+    if (history_valid){
+        history_append(buf, len);
+    }
+}
 
-        pthread_mutex_lock(&fd_lock);
-        fd = open(DATA_FILE,O_WRONLY|O_APPEND|O_CREAT, 0644);
-        t = time(NULL);
-        t_local = localtime(&t);
-        strftime(time_str, sizeof(time_str), "%a, %d %b %Y %T %z", t_local);
-        int len = sprintf(log_str, "timestamp:%s\n", time_str);
-        write(fd, log_str, len);
+static void history_refresh(void){
+}
+#endif
+
+/**
+ * Rebuild the history from the store and start caching again.
+ * Caller must hold fd_lock.
+ */
+static void history_load(void){
+    #if USE_AESD_CHAR_DEVICE
+        if (history_fd < 0){
+            history_fd = open(DATA_FILE, O_RDONLY | O_CLOEXEC);
+        }
+        if (history_fd < 0){
+            history_publish(NULL, 0, false);
+            return;
+        }
+        struct aesd_seekseq bounds;
+        bool has_seqs;
+        size_t len = 0;
+        history_buf* fresh = history_read(&len, &bounds, &has_seqs);
+        if (fresh == NULL){
+            syslog(LOG_DEBUG, "History cache disabled: %s", strerror(errno));
+            history_publish(NULL, 0, false);
+            return;
+        }
+        history_adopt(fresh, len, &bounds, has_seqs);
+    #else
+        int fd = open(DATA_FILE, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        history_buf* buf = NULL;
+        if (fd >= 0 && fstat(fd, &st) == 0){
+            buf = history_alloc(st.st_size > BUFF_SIZE ? st.st_size : BUFF_SIZE);
+            if (buf != NULL && pread(fd, buf->data, st.st_size, 0) != st.st_size){
+                free(buf);
+                buf = NULL;
+            }
+        }
+        if (buf != NULL){
+            history_publish(buf, st.st_size, true);
+        }else{
+            history_publish(NULL, 0, false);
+        }
+        if (fd >= 0){
+            close(fd);
+        }
+    #endif
+}
+
+/**
+ * Stop caching while another instance may append to the store.
+ */
+static void history_invalidate(void){
+    lockprof_mutex_lock(&fd_lock);
+    #if USE_AESD_CHAR_DEVICE
+        // history_load() takes over once the other instance is gone
+        history_stale = false;
+    #endif
+    history_publish(NULL, 0, false);
+    lockprof_mutex_unlock(&fd_lock);
+}
+
+/**
+ * @param inherited true when a previous instance handed over the store on hot restart
+ */
+static void history_init(bool inherited){
+    if (inherited){
+        // the previous instance is still draining and may append, load once it is gone
+        history_valid = false;
+        return;
+    }
+    #if USE_AESD_CHAR_DEVICE
+        // the driver keeps its history across server restarts
+        lockprof_mutex_lock(&fd_lock);
+        history_load();
+        lockprof_mutex_unlock(&fd_lock);
+    #endif
+}
+
+/**
+ * Append @param len bytes of @param buf to the shared store handle.
+ * Caller must hold fd_lock so records from different writers do not interleave.
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int store_commit(const char* buf, size_t len){
+    ssize_t ret;
+    const char* pos = buf;
+    size_t left = len;
+    while (left > 0){
+        ret = write(store_fd, pos, left);
+        if (ret < 0){
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        pos += ret;
+        left -= ret;
+    }
+    history_update(buf, len);
+    return 0;
+}
+
+static int send_all(int fd, const char* buf, size_t len){
+    ssize_t ret;
+    while (len > 0){
+        ret = send(fd, buf, len, MSG_NOSIGNAL);
+        if (ret < 0){
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int timestamp_timer_setup(void){
+    if (config.timestamp_interval <= 0){
+        return -1;
+    }
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0){
+        syslog(LOG_DEBUG, "Unable to create timestamp timer: %s", strerror(errno));
+        return -1;
+    }
+    struct itimerspec spec = {
+        .it_interval = { .tv_sec = config.timestamp_interval },
+        .it_value = { .tv_sec = config.timestamp_interval },
+    };
+    if (timerfd_settime(fd, 0, &spec, NULL) < 0){
+        syslog(LOG_DEBUG, "Unable to arm timestamp timer: %s", strerror(errno));
         close(fd);
-        pthread_mutex_unlock(&fd_lock);
+        return -1;
+    }
+    syslog(LOG_DEBUG, "Timestamp every %d s", config.timestamp_interval);
+    return fd;
+}
+
+static void timestamp_timer_handle(int fd){
+    uint64_t expirations;
+    time_t t;
+    struct tm t_local;
+    char time_str[200];
+    char log_str[211];
+
+    // drain the counter, missed ticks collapse into a single record
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)){
+        return;
+    }
 
-        //enable cancellation in thread safe block
-        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    t = time(NULL);
+    localtime_r(&t, &t_local);
+    if (strftime(time_str, sizeof(time_str), config.timestamp_format, &t_local) == 0){
+        syslog(LOG_DEBUG, "Timestamp format produced no output");
+        return;
     }
+    int len = snprintf(log_str, sizeof(log_str), "timestamp:%s\n", time_str);
+    if (len >= (int) sizeof(log_str)){
+        len = sizeof(log_str) - 1;
+        log_str[len - 1] = '\n';
+    }
+
+    lockprof_mutex_lock(&fd_lock);
+    if (store_commit(log_str, len) < 0){
+        syslog(LOG_DEBUG, "Timestamp write failed: %s", strerror(errno));
+    }
+    lockprof_mutex_unlock(&fd_lock);
+    history_refresh();
 }
 
 void thread_list_cleanup(bool completed_only){
@@ -93,6 +567,7 @@ void thread_list_cleanup(bool completed_only){
             ret = pthread_join(elem->thread_data->tid, NULL);
             if ( ret == 0){
                 syslog(LOG_DEBUG, "Thread %lu joined, cleaning memory", elem->thread_data->tid);
+                close(elem->thread_data->client_fd);
                 SLIST_REMOVE(&head, elem, thread_entry, next);
                 free(elem->thread_data);
                 free(elem);
@@ -105,19 +580,114 @@ void thread_list_cleanup(bool completed_only){
 
 void client_thread_cleanup(client_thread_data* thread_data){
 
-    if (thread_data->file_fd > 0 ){
+    if (thread_data->file_fd >= 0 ){
         close(thread_data->file_fd);
         syslog(LOG_DEBUG, "File closed by #%lu", thread_data->tid);
     }
 
-    pthread_mutex_unlock(&fd_lock);
-    syslog(LOG_DEBUG, "Mutex released by #%lu", thread_data->tid);
+    free(thread_data->packet);
+    thread_data->packet = NULL;
 
-    close(thread_data->client_fd);
+    // the fd itself is closed by the joiner, so the main loop can still shut it down safely
+    shutdown(thread_data->client_fd, SHUT_RDWR);
     syslog(LOG_DEBUG, "Closed connection from %s", thread_data->client_ip);
 
+    atomic_fetch_sub(&active_connections, 1);
     //set thread as completed 
     thread_data->completed = true;
+
+    // wake the main loop so it joins this thread right away
+    eventfd_write(done_fd, 1);
+}
+
+/**
+ * Unblock every client still in recv() or send() so it exits promptly.
+ */
+static void thread_list_shutdown(void){
+    thread_entry* elem;
+    SLIST_FOREACH(elem, &head, next) {
+        if (!elem->thread_data->completed){
+            shutdown(elem->thread_data->client_fd, SHUT_RDWR);
+        }
+    }
+}
+
+/**
+ * Receive from the client until a newline shows up, without holding fd_lock.
+ * The packet grows up to config.max_packet_bytes and each recv is bounded
+ * by the idle timeout set on the socket.
+ * @return packet length, or -1 if the client went away, timed out or overflowed
+ */
+static ssize_t client_recv_packet(client_thread_data* thread_data){
+    size_t cap = 0;
+    size_t len = 0;
+    ssize_t bytes_recv;
+    char* nl = NULL;
+
+    while (nl == NULL){
+        if (len == cap){
+            if (cap >= config.max_packet_bytes){
+                syslog(LOG_DEBUG, "Packet from %s exceeds %zu bytes, dropping",
+                    thread_data->client_ip, config.max_packet_bytes);
+                return -1;
+            }
+            cap = cap ? cap * 2 : BUFF_SIZE;
+            if (cap > config.max_packet_bytes)
+                cap = config.max_packet_bytes;
+            char* grown = realloc(thread_data->packet, cap);
+            if (grown == NULL){
+                syslog(LOG_DEBUG, "Out of memory receiving from %s", thread_data->client_ip);
+                return -1;
+            }
+            thread_data->packet = grown;
+        }
+
+        bytes_recv = recv(thread_data->client_fd, thread_data->packet + len, cap - len, 0);
+        if (bytes_recv < 0 && errno == EINTR){
+            continue;
+        }
+        if (bytes_recv <= 0){
+            if (bytes_recv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+                syslog(LOG_DEBUG, "Client %s idle for %d s, closing", thread_data->client_ip, config.idle_timeout);
+            }
+            return -1;
+        }
+        syslog(LOG_DEBUG, "Received %zd bytes", bytes_recv);
+        nl = memchr(thread_data->packet + len, '\n', bytes_recv);
+        len += bytes_recv;
+    }
+    return len;
+}
+
+/**
+ * Run @param packet as a driver command if it is one, on @param file_fd which is opened
+ * on the store first if it is -1. The reply is then read from that handle.
+ * @return true if the packet was a command and must not be stored
+ */
+static bool client_handle_command(int* file_fd, char* packet, size_t len){
+    bool handled = false;
+    #if USE_AESD_CHAR_DEVICE
+        struct aesd_seekto ioctl_args;
+        char last = packet[len - 1];
+        packet[len - 1] = '\0';
+        if(sscanf(packet, "AESDCHAR_IOCSEEKTO:%u,%u",&ioctl_args.write_cmd,&ioctl_args.write_cmd_offset) == 2 ){
+            if (*file_fd < 0){
+                *file_fd = open(DATA_FILE, O_RDONLY | O_CLOEXEC);
+            }
+            if (*file_fd >= 0){
+                ioctl(*file_fd,AESDCHAR_IOCSEEKTO,&ioctl_args);
+            }else{
+                syslog(LOG_DEBUG, "File cannot be opened, error: %s", strerror(errno));
+            }
+            handled = true;
+        }
+        packet[len - 1] = last;
+    #else
+        (void) file_fd;
+        (void) packet;
+        (void) len;
+    #endif
+    return handled;
 }
 
 static void* client_thread_func(void* thread_args){
@@ -127,99 +697,269 @@ static void* client_thread_func(void* thread_args){
 
     //setup buffer
     char buffer[BUFF_SIZE];
-    memset(buffer,0,sizeof(buffer));
-
-    pthread_mutex_lock(&fd_lock);
-    syslog(LOG_DEBUG, "Mutex aquired by #%lu", thread_data->tid);
-    int tfile_fd = open(DATA_FILE,O_RDWR | O_APPEND | O_CREAT , 0644);
-    thread_data->file_fd = tfile_fd;
-    if (tfile_fd < 0){
-        syslog(LOG_DEBUG, "File cannot be opened, error: %s",strerror(errno));
+
+    // private handle for a SEEKTO or a reply the cache cannot serve, it keeps its own read position.
+    // Opened only then: a reader per client would also keep the driver off its lock-free path.
+    thread_data->file_fd = -1;
+
+    //receive the whole message before touching the store
+    ssize_t packet_len = client_recv_packet(thread_data);
+    if (packet_len < 0){
         client_thread_cleanup(thread_data);
         pthread_exit(thread_data);
     }
-    syslog(LOG_DEBUG, "File opened for appending by #%lu", thread_data->tid);
-
-    //receive message and dump to a file
-    bool got_newline = false;
-    bool need_seek = true;
-    ssize_t bytes_recv;
-    while(!got_newline){
-        
-        bytes_recv = recv(thread_data->client_fd,buffer,sizeof(buffer),0);
-        syslog(LOG_DEBUG, "Received %zd bytes", bytes_recv);
 
-        #if USE_AESD_CHAR_DEVICE
-            struct aesd_seekto ioctl_args;
-            int filled;
-            if((filled = sscanf(buffer, "AESDCHAR_IOCSEEKTO:%u,%u",&ioctl_args.write_cmd,&ioctl_args.write_cmd_offset)) == 2 ){
-                ioctl(tfile_fd,AESDCHAR_IOCSEEKTO,&ioctl_args);
-                need_seek =false;
-                break;
-            }
-        #endif
-        ret = write(tfile_fd,buffer, bytes_recv);
-        syslog(LOG_DEBUG, "Wrote %d bytes", ret);
+    bool need_seek = !client_handle_command(&thread_data->file_fd, thread_data->packet, packet_len);
+    if(need_seek){
+        // queue depth is what the accept loop throttles on
+        atomic_fetch_add(&pending_commits, 1);
+        lockprof_mutex_lock(&fd_lock);
+        ret = store_commit(thread_data->packet, packet_len);
+        lockprof_mutex_unlock(&fd_lock);
+        history_refresh();
+        atomic_fetch_sub(&pending_commits, 1);
+        syslog(LOG_DEBUG, "Wrote %zd bytes", packet_len);
         if (ret < 0){
             syslog(LOG_DEBUG, "Error: %s", strerror(errno));
             client_thread_cleanup(thread_data);
             pthread_exit(thread_data);
         }
-        if(buffer[bytes_recv-1] == '\n')
-            got_newline = true;
-        memset(buffer,0,sizeof(buffer));
 
-    }
-    if(need_seek){
-        lseek(tfile_fd, 0, SEEK_SET);
-    }
+        // a plain reply is the whole history, serve it from the cache
+        history_buf* snapshot;
+        size_t snapshot_len;
+        if (history_get(&snapshot, &snapshot_len)){
+            ret = snapshot_len ? send_all(thread_data->client_fd, snapshot->data, snapshot_len) : 0;
+            history_put(snapshot);
+            syslog(LOG_DEBUG, "Sent %zu cached bytes", snapshot_len);
+            client_thread_cleanup(thread_data);
+            pthread_exit(thread_data);
+        }
 
-    if (tfile_fd == 0){
-        syslog(LOG_DEBUG, "File seek failed");
+        thread_data->file_fd = open(DATA_FILE, O_RDONLY | O_CLOEXEC);
+        if (thread_data->file_fd < 0){
+            syslog(LOG_DEBUG, "File cannot be opened, error: %s",strerror(errno));
+            client_thread_cleanup(thread_data);
+            pthread_exit(thread_data);
+        }
+        syslog(LOG_DEBUG, "File opened for reading by #%lu", thread_data->tid);
     }
-    syslog(LOG_DEBUG, "File seek to start");
 
-    int bytes_read;
-    while ((bytes_read = read(tfile_fd,buffer, sizeof(buffer))) > 0) {
+    // after a SEEKTO the reply starts at this handle's own position, read it from the store
+    ssize_t bytes_read;
+    while ((bytes_read = read(thread_data->file_fd,buffer, sizeof(buffer))) > 0) {
 
-        ret = send(thread_data->client_fd,buffer,bytes_read,0);
+        ret = send_all(thread_data->client_fd,buffer,bytes_read);
         if (ret < 0 ){
             client_thread_cleanup(thread_data);
-            thread_data->completed = true;
             pthread_exit(thread_data);
         }
-        syslog(LOG_DEBUG, "Sent %d bytes",ret);
-
-        memset(buffer,0,sizeof(buffer));
+        syslog(LOG_DEBUG, "Sent %zd bytes",bytes_read);
     }
     client_thread_cleanup(thread_data);
     pthread_exit(thread_data);
 }
 
-static void graceful_stop(int signum){
-    syslog(LOG_DEBUG, "Caught signal, exiting");
-    if (server_fd > 0){
+/**
+ * Stop accepting, give in-flight clients up to config.drain_timeout seconds to
+ * finish, then cut the remaining ones off and exit.
+ * Runs from the main loop, never from a signal handler.
+ */
+static void graceful_stop(void){
+    syslog(LOG_DEBUG, "Shutting down, draining %d clients", atomic_load(&active_connections));
+    if (server_fd >= 0){
         close(server_fd);
+        server_fd = -1;
         syslog(LOG_DEBUG, "Closing server socket");
     }
 
+    //disarm timestamp timer
+    if (timer_fd >= 0){
+        close(timer_fd);
+        timer_fd = -1;
+    }
+    if (handoff_fd >= 0){
+        close(handoff_fd);
+        handoff_fd = -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    time_t deadline = now.tv_sec + config.drain_timeout;
+    struct pollfd events[2] = {
+        { .fd = done_fd, .events = POLLIN },
+        { .fd = signal_fd, .events = POLLIN },
+    };
+    while (atomic_load(&active_connections) > 0){
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec >= deadline){
+            syslog(LOG_DEBUG, "Drain timeout, closing remaining clients");
+            break;
+        }
+        if (poll(events, 2, (deadline - now.tv_sec) * 1000) < 0 && errno != EINTR){
+            break;
+        }
+        if (events[1].revents & POLLIN){
+            struct signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof(info)) == sizeof(info) && info.ssi_signo == SIGUSR1){
+                lockprof_dump();
+                continue;
+            }
+            syslog(LOG_DEBUG, "Second signal, closing remaining clients");
+            break;
+        }
+        if (events[0].revents & POLLIN){
+            eventfd_t count;
+            eventfd_read(done_fd, &count);
+            thread_list_cleanup(true);
+        }
+    }
+
     //join all thread
+    thread_list_shutdown();
     thread_list_cleanup(false);
 
-    //join timestamp thread
-    // int ret = pthread_cancel(timestamp_thread_id);
-    // if ( ret != 0 ){
-    //     //if fail to cancel try to wait
-    //     sleep(1);
-    //     pthread_cancel(timestamp_thread_id);
-    // }
-    // pthread_join(timestamp_thread_id, NULL);
+    if (store_fd >= 0){
+        close(store_fd);
+    }
 
     pthread_mutex_destroy(&fd_lock);
     closelog();
     exit(EXIT_SUCCESS);
 }
 
+/**
+ * Hot restart, new instance side: fetch the listening socket from the
+ * instance serving @param path.
+ * The connection is kept in handoff_peer_fd, it hangs up once the previous instance exits.
+ * @return the inherited listening socket, -1 if nobody is serving
+ */
+static int handoff_receive(const char* path){
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0){
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0){
+        close(fd);
+        return -1;
+    }
+
+    char byte;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    int listen_fd = -1;
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) == 1){
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+            memcpy(&listen_fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (listen_fd >= 0){
+        handoff_peer_fd = fd;
+    }else{
+        close(fd);
+    }
+    return listen_fd;
+}
+
+/**
+ * Hot restart, new instance side: the previous instance finished draining,
+ * the store is ours alone now.
+ */
+static void handoff_peer_exit(void){
+    syslog(LOG_DEBUG, "Previous instance exited");
+    close(handoff_peer_fd);
+    handoff_peer_fd = -1;
+    lockprof_mutex_lock(&fd_lock);
+    history_load();
+    lockprof_mutex_unlock(&fd_lock);
+}
+
+/**
+ * Hot restart, serving side: listen on @param path for the next instance.
+ */
+static int handoff_listen(const char* path){
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0){
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0){
+        syslog(LOG_DEBUG, "Unable to serve hot restart on %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Pass the listening socket to the instance connecting on @param fd.
+ * @return true if the new instance got the socket and this one should drain
+ */
+static bool handoff_send(int fd){
+    int peer = accept(fd, NULL, NULL);
+    if (peer < 0){
+        return false;
+    }
+    char byte = 0;
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &server_fd, sizeof(int));
+    bool sent = sendmsg(peer, &msg, MSG_NOSIGNAL) == 1;
+    syslog(LOG_DEBUG, sent ? "Listening socket handed off" : "Listening socket handoff failed");
+    if (!sent){
+        close(peer);
+        return false;
+    }
+    // left open until exit, the new instance takes the hangup as the end of the drain
+    handoff_peer_fd = peer;
+    history_invalidate();
+    return true;
+}
+
+/**
+ * io_uring backend: the backend wrote @param packet to the store itself, keep the history in step.
+ */
+static void uring_on_commit(const char* packet, size_t len){
+    lockprof_mutex_lock(&fd_lock);
+    history_update(packet, len);
+    lockprof_mutex_unlock(&fd_lock);
+    history_refresh();
+}
+
+static bool uring_get_history(void** ref, const char** data, size_t* len){
+    history_buf* buf;
+    bool valid = history_get(&buf, len);
+    *ref = valid ? buf : NULL;
+    *data = valid && buf != NULL ? buf->data : NULL;
+    return valid;
+}
+
+static void uring_put_history(void* ref){
+    history_put(ref);
+}
+
 static void daemonize(){
     pid_t pid;
 
@@ -260,11 +1000,6 @@ static void daemonize(){
         syslog(LOG_DEBUG, "Stop parent #2");
         exit(EXIT_SUCCESS);
     }
-
-    //add signal handlers again
-    signal(SIGINT, graceful_stop);
-    signal(SIGTERM, graceful_stop);
-    syslog(LOG_DEBUG, "Registered daemon signal handler");
 }
 
 // get sockaddr, IPv4 or IPv6:
@@ -277,6 +1012,25 @@ static void *get_in_addr(struct sockaddr *sa)
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
+static void usage(const char* prog){
+    fprintf(stderr, "Usage: %s [-d] [-t timestamp_seconds] [-f timestamp_format]\n"
+        "    [-c max_connections] [-m max_packet_bytes] [-i idle_timeout_seconds]\n"
+        "    [-q max_pending_commits] [-u] [-D drain_timeout_seconds]\n"
+        "    [-H hot_restart_socket]\n", prog);
+}
+
+/**
+ * Parse @param arg as a number from 1 to @param max into @param value, rejecting anything
+ * else, trailing junk included. A 0x or 0 prefix reads it as hex or octal.
+ * @return false if @param arg is not such a number
+ */
+static bool parse_positive(const char* arg, long max, long* value){
+    char* end;
+    errno = 0;
+    *value = strtol(arg, &end, 0);
+    return errno == 0 && end != arg && *end == '\0' && *value > 0 && *value <= max;
+}
+
 int main(int argc, char **argv){
 
     setlogmask(LOG_UPTO (LOG_DEBUG));
@@ -284,66 +1038,155 @@ int main(int argc, char **argv){
     syslog(LOG_DEBUG, "Starting aesdserver");
 
 
-    signal(SIGINT, graceful_stop);
-    signal(SIGTERM, graceful_stop);
-    syslog(LOG_DEBUG, "Registered signal handler");
+    // signals are read from signal_fd in the main loop, block them in every thread
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+#if LOCKPROF
+    // dumps the lock statistics instead of stopping
+    sigaddset(&stop_signals, SIGUSR1);
+#endif
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
     int ret;
-    struct addrinfo hints;
-    struct addrinfo* servinfo;
-
-    //socket configurations
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;     // don't care IPv4 or IPv6
-    hints.ai_socktype = SOCK_STREAM; // TCP stream sockets
-    hints.ai_flags = AI_PASSIVE;     // fill in my IP for me
-    
-    //get socket info
-    ret = getaddrinfo(NULL,"9000", &hints, &servinfo);
-    if (ret < 0){
-        syslog(LOG_DEBUG, "Unable to get address info");
-        return -1;
+    int opt;
+    long value;
+    bool run_as_daemon = false;
+    while ((opt = getopt(argc, argv, "dt:f:c:m:i:q:uD:H:")) != -1){
+        switch (opt){
+            case 'd':
+                run_as_daemon = true;
+                break;
+            case 't':
+                config.timestamp_interval = atoi(optarg);
+                break;
+            case 'f':
+                config.timestamp_format = optarg;
+                break;
+            case 'c':
+                if (!parse_positive(optarg, INT_MAX, &value)){
+                    fprintf(stderr, "-c needs a positive number, not %s\n", optarg);
+                    usage(argv[0]);
+                    return -1;
+                }
+                config.max_connections = value;
+                break;
+            case 'm':
+                if (!parse_positive(optarg, LONG_MAX, &value)){
+                    fprintf(stderr, "-m needs a positive number, not %s\n", optarg);
+                    usage(argv[0]);
+                    return -1;
+                }
+                config.max_packet_bytes = value;
+                break;
+            case 'i':
+                config.idle_timeout = atoi(optarg);
+                break;
+            case 'q':
+                if (!parse_positive(optarg, INT_MAX, &value)){
+                    fprintf(stderr, "-q needs a positive number, not %s\n", optarg);
+                    usage(argv[0]);
+                    return -1;
+                }
+                config.max_pending_commits = value;
+                break;
+            case 'u':
+                config.use_io_uring = true;
+                break;
+            case 'D':
+                config.drain_timeout = atoi(optarg);
+                break;
+            case 'H':
+                config.handoff_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
     }
 
-    //create socket file_fd
-    server_fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
-    if (ret < 0){
-        syslog(LOG_DEBUG, "Unable to create server socket");
-        return -1;
-    }
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)); 
-    //bind socket to address
-    ret = bind(server_fd, servinfo->ai_addr, servinfo->ai_addrlen);
-    if (ret < 0){
-        syslog(LOG_DEBUG, "Socket bind failed");
-        return -1;
+    // on hot restart the previous instance hands over its listening socket
+    bool inherited = false;
+    if (config.handoff_path != NULL){
+        server_fd = handoff_receive(config.handoff_path);
+        inherited = server_fd >= 0;
     }
 
-    //check if program should be deamonized
-    if(argc==2){
-        if(strcmp(argv[1], "-d") == 0){
+    if (inherited){
+        syslog(LOG_DEBUG, "Inherited listening socket from previous instance");
+        //check if program should be deamonized
+        if(run_as_daemon){
             syslog(LOG_DEBUG, "Turning into a deamon");
             daemonize();
         }
-    }
+    }else{
+        struct addrinfo hints;
+        struct addrinfo* servinfo;
+
+        //socket configurations
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;     // don't care IPv4 or IPv6
+        hints.ai_socktype = SOCK_STREAM; // TCP stream sockets
+        hints.ai_flags = AI_PASSIVE;     // fill in my IP for me
+
+        //get socket info
+        ret = getaddrinfo(NULL,"9000", &hints, &servinfo);
+        if (ret != 0){
+            syslog(LOG_DEBUG, "Unable to get address info");
+            return -1;
+        }
 
-    //free memory
-    freeaddrinfo(servinfo);
+        //create socket file_fd
+        server_fd = socket(servinfo->ai_family, servinfo->ai_socktype | SOCK_CLOEXEC, servinfo->ai_protocol);
+        if (server_fd < 0){
+            syslog(LOG_DEBUG, "Unable to create server socket");
+            return -1;
+        }
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)); 
+        //bind socket to address
+        ret = bind(server_fd, servinfo->ai_addr, servinfo->ai_addrlen);
+        if (ret < 0){
+            syslog(LOG_DEBUG, "Socket bind failed");
+            return -1;
+        }
 
-    //start listening
-    ret = listen(server_fd,1);
-    if (ret < 0){
-        syslog(LOG_DEBUG, "Unable to listen for new connection");
-        return -1;
+        //check if program should be deamonized
+        if(run_as_daemon){
+            syslog(LOG_DEBUG, "Turning into a deamon");
+            daemonize();
+        }
+
+        //free memory
+        freeaddrinfo(servinfo);
+
+        //start listening
+        ret = listen(server_fd,SOMAXCONN);
+        if (ret < 0){
+            syslog(LOG_DEBUG, "Unable to listen for new connection");
+            return -1;
+        }
     }
 
-    int file_fd = open(DATA_FILE,O_RDONLY | O_WRONLY | O_TRUNC | O_CREAT, 0644);
-    if (file_fd == 0){
+    // keep what the previous instance stored when taking over from it
+    store_fd = open(DATA_FILE, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC | (inherited ? 0 : O_TRUNC), 0644);
+    if (store_fd < 0){
         syslog(LOG_DEBUG, "File cannot be opened");
         return -1;
     }
-    close(file_fd);
-    syslog(LOG_DEBUG, "File cleared");
+    syslog(LOG_DEBUG, inherited ? "File kept" : "File cleared");
+
+    signal_fd = signalfd(-1, &stop_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (signal_fd < 0 || done_fd < 0){
+        syslog(LOG_DEBUG, "Unable to set up event fds: %s", strerror(errno));
+        return -1;
+    }
+    syslog(LOG_DEBUG, "Registered signal handler");
+    if (config.handoff_path != NULL){
+        handoff_fd = handoff_listen(config.handoff_path);
+    }
 
     //wait for client connection
     struct sockaddr_storage client_addr;
@@ -357,18 +1200,103 @@ int main(int argc, char **argv){
         syslog(LOG_DEBUG, "Unable to setup mutex");
     }
 
-    //pthread_create(&timestamp_thread_id,NULL, timestamp_thread_func,NULL);
+    history_init(inherited);
+    timer_fd = timestamp_timer_setup();
+
+    if (config.use_io_uring){
+        struct uring_backend_params uring_params = {
+            .server_fd = server_fd,
+            .store_fd = store_fd,
+            .store_path = DATA_FILE,
+            .max_connections = config.max_connections,
+            .max_packet_bytes = config.max_packet_bytes,
+            .idle_timeout = config.idle_timeout,
+            .max_pending_commits = config.max_pending_commits,
+            .timer_fd = timer_fd,
+            .on_timer = timestamp_timer_handle,
+            .handle_command = client_handle_command,
+            .on_commit = uring_on_commit,
+            .get_history = uring_get_history,
+            .put_history = uring_put_history,
+            .signal_fd = signal_fd,
+            .handoff_fd = handoff_fd,
+            .on_handoff = handoff_send,
+            .handoff_peer_fd = handoff_peer_fd,
+            .on_peer_exit = handoff_peer_exit,
+            .drain_timeout = config.drain_timeout,
+        };
+        if (uring_backend_run(&uring_params) == 0){
+            syslog(LOG_DEBUG, "io_uring backend drained, exiting");
+            closelog();
+            exit(EXIT_SUCCESS);
+        }
+        syslog(LOG_DEBUG, "io_uring backend unavailable (%s), using client threads", strerror(errno));
+    }
 
     //init thread list
     SLIST_INIT(&head);
     int client_fd;
 
+    struct pollfd events[6] = {
+        { .fd = server_fd, .events = POLLIN },
+        { .fd = timer_fd, .events = POLLIN },
+        { .fd = signal_fd, .events = POLLIN },
+        { .fd = done_fd, .events = POLLIN },
+        { .fd = handoff_fd, .events = POLLIN },
+        { .fd = handoff_peer_fd, .events = POLLIN },
+    };
+    // a negative fd is skipped by poll, so a disabled timer costs nothing
+    nfds_t nevents = 6;
+
     while (true) {
 
-        // check list and join completed thread
-        thread_list_cleanup(true);
+        // stop accepting while overloaded, pending clients wait in the backlog
+        bool throttled = atomic_load(&active_connections) >= config.max_connections ||
+            atomic_load(&pending_commits) >= config.max_pending_commits;
+        events[0].events = throttled ? 0 : POLLIN;
 
-        syslog(LOG_DEBUG, "Waiting for new client");
+        syslog(LOG_DEBUG, throttled ? "Accept paused, server busy" : "Waiting for new client");
+        ret = poll(events, nevents, throttled ? BACKPRESSURE_POLL_MS : -1);
+        if (ret < 0){
+            if (errno != EINTR){
+                syslog(LOG_DEBUG, "Poll failed: %s", strerror(errno));
+            }
+            continue;
+        }
+        if (events[2].revents & POLLIN){
+            struct signalfd_siginfo info;
+            if (read(signal_fd, &info, sizeof(info)) == sizeof(info)){
+                if (info.ssi_signo == SIGUSR1){
+                    lockprof_dump();
+                }
+                else {
+                    syslog(LOG_DEBUG, "Caught signal %u, exiting", info.ssi_signo);
+                    graceful_stop();
+                }
+            }
+        }
+        if ((events[4].revents & POLLIN) && handoff_send(handoff_fd)){
+            // the new instance accepts from now on, finish what is in flight
+            graceful_stop();
+        }
+        if (events[5].revents & (POLLIN | POLLHUP)){
+            handoff_peer_exit();
+            events[5].fd = -1;
+        }
+        if (events[3].revents & POLLIN){
+            // check list and join completed thread
+            eventfd_t count;
+            eventfd_read(done_fd, &count);
+            thread_list_cleanup(true);
+        }
+        if (events[1].revents & POLLIN){
+            timestamp_timer_handle(timer_fd);
+        }
+        if (!(events[0].revents & POLLIN)){
+            continue;
+        }
+
+        client_addr_size = sizeof(client_addr);
         client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_addr_size);
         if (client_fd < 0){
             syslog(LOG_DEBUG, "Connection accept failed");
@@ -379,15 +1307,27 @@ int main(int argc, char **argv){
             client_ip, sizeof client_ip);
         syslog(LOG_DEBUG, "Accepted connection from %s", client_ip);
 
-        client_thread_data* ct_data = malloc(sizeof(client_thread_data));
+        // bound how long a silent or non-reading client can hold its thread
+        struct timeval timeout = { .tv_sec = config.idle_timeout };
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        client_thread_data* ct_data = calloc(1, sizeof(client_thread_data));
+        if (ct_data == NULL){
+            close(client_fd);
+            continue;
+        }
         ct_data->tid = tnum;
         tnum = tnum + 1;
         strcpy(ct_data->client_ip, client_ip);
         ct_data->client_fd = client_fd;
         ct_data->completed = false;
 
+        atomic_fetch_add(&active_connections, 1);
         ret = pthread_create(&ct_data->tid,NULL,&client_thread_func, ct_data);
         if ( ret != 0){
+            atomic_fetch_sub(&active_connections, 1);
+            close(client_fd);
             free(ct_data);
             continue;
         }
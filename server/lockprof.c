@@ -0,0 +1,302 @@
+/**
+ * @file lockprof.c
+ * @brief Contention profiler behind the lockprof_mutex_* macros
+ *
+ * Statistics are kept per mutex address in a fixed open addressed table, so the profiled
+ * code keeps using plain pthread_mutex_t. A mutex destroyed and another created at the same
+ * address share their statistics. Call sites chain themselves into a list on first use.
+ * Every counter is updated with relaxed atomics, a dump may run at any time.
+ */
+
+// this file is only linked in profiling builds
+#ifndef LOCKPROF
+#define LOCKPROF 1
+#endif
+#include "lockprof.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syslog.h>
+#include <time.h>
+
+#define LOCKPROF_MAX_LOCKS 64
+#define LOCKPROF_MAX_SITES 256
+#define LOCKPROF_TOP_SITES 10
+// bucket b counts durations in [2^(b-1), 2^b) ns, the last one everything longer
+#define LOCKPROF_BUCKETS 40
+
+struct lock_stats {
+    _Atomic(pthread_mutex_t*) mutex;
+    _Atomic(const char*) name;
+    atomic_ulong acquired;
+    atomic_ulong contended;
+    atomic_ullong wait_ns;
+    atomic_ullong wait_max_ns;
+    atomic_ullong hold_ns;
+    atomic_ullong hold_max_ns;
+    atomic_ulong wait_hist[LOCKPROF_BUCKETS];
+    atomic_ulong hold_hist[LOCKPROF_BUCKETS];
+    uint64_t held_since;        // only touched by the holder
+};
+
+static struct lock_stats locks[LOCKPROF_MAX_LOCKS];
+static _Atomic(struct lockprof_site*) sites;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+static const char* lock_label(const char* name)
+{
+    return name[0] == '&' ? name + 1 : name;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void dump_at_exit(void)
+{
+    atexit(lockprof_dump);
+}
+
+/**
+ * @return the statistics of @param mutex, NULL when the table is full
+ */
+static struct lock_stats* lock_stats_get(pthread_mutex_t* mutex, const char* name)
+{
+    size_t i = ((uintptr_t) mutex >> 4) * 0x9e3779b97f4a7c15ULL % LOCKPROF_MAX_LOCKS;
+
+    for (size_t probe = 0; probe < LOCKPROF_MAX_LOCKS; probe++, i = (i + 1) % LOCKPROF_MAX_LOCKS){
+        pthread_mutex_t* key = atomic_load_explicit(&locks[i].mutex, memory_order_acquire);
+        if (key == mutex){
+            return &locks[i];
+        }
+        if (key == NULL && name != NULL){
+            if (atomic_compare_exchange_strong(&locks[i].mutex, &key, mutex)){
+                atomic_store(&locks[i].name, lock_label(name));
+                pthread_once(&exit_once, dump_at_exit);
+                return &locks[i];
+            }
+            if (key == mutex){
+                return &locks[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+static void site_register(struct lockprof_site* site)
+{
+    struct lockprof_site* head;
+
+    if (atomic_load_explicit(&site->registered, memory_order_relaxed) ||
+            atomic_exchange(&site->registered, true)){
+        return;
+    }
+    head = atomic_load(&sites);
+    do {
+        site->next = head;
+    } while (!atomic_compare_exchange_weak(&sites, &head, site));
+}
+
+static void max_update(atomic_ullong* max, uint64_t value)
+{
+    unsigned long long cur = atomic_load_explicit(max, memory_order_relaxed);
+
+    while (cur < value && !atomic_compare_exchange_weak_explicit(max, &cur, value,
+                memory_order_relaxed, memory_order_relaxed)){
+    }
+}
+
+static void hist_add(atomic_ulong* hist, uint64_t ns)
+{
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+
+    atomic_fetch_add_explicit(&hist[bucket < LOCKPROF_BUCKETS ? bucket : LOCKPROF_BUCKETS - 1], 1,
+            memory_order_relaxed);
+}
+
+/**
+ * Account an acquisition of the lock of @param stats from @param site after waiting @param wait_ns
+ */
+static void record_acquire(struct lock_stats* stats, struct lockprof_site* site, bool contended,
+        uint64_t wait_ns, uint64_t now)
+{
+    atomic_fetch_add_explicit(&site->acquired, 1, memory_order_relaxed);
+    if (contended){
+        atomic_fetch_add_explicit(&site->contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&site->wait_ns, wait_ns, memory_order_relaxed);
+    }
+    if (stats == NULL){
+        return;
+    }
+    stats->held_since = now;
+    atomic_fetch_add_explicit(&stats->acquired, 1, memory_order_relaxed);
+    if (contended){
+        atomic_fetch_add_explicit(&stats->contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stats->wait_ns, wait_ns, memory_order_relaxed);
+        max_update(&stats->wait_max_ns, wait_ns);
+    }
+    hist_add(stats->wait_hist, wait_ns);
+}
+
+int lockprof_lock(pthread_mutex_t* mutex, struct lockprof_site* site)
+{
+    struct lock_stats* stats = lock_stats_get(mutex, site->lock_name);
+    bool contended = false;
+    uint64_t start = 0;
+    uint64_t now;
+    int ret;
+
+    site_register(site);
+    // only time the wait when there is one, the uncontended path costs a single clock read
+    ret = pthread_mutex_trylock(mutex);
+    if (ret == EBUSY){
+        contended = true;
+        start = now_ns();
+        ret = pthread_mutex_lock(mutex);
+    }
+    if (ret != 0){
+        return ret;
+    }
+    now = now_ns();
+    record_acquire(stats, site, contended, contended ? now - start : 0, now);
+    return 0;
+}
+
+int lockprof_trylock(pthread_mutex_t* mutex, struct lockprof_site* site)
+{
+    struct lock_stats* stats = lock_stats_get(mutex, site->lock_name);
+    int ret;
+
+    site_register(site);
+    ret = pthread_mutex_trylock(mutex);
+    if (ret == EBUSY){
+        // a failed attempt is contention without an acquisition
+        atomic_fetch_add_explicit(&site->contended, 1, memory_order_relaxed);
+        if (stats != NULL){
+            atomic_fetch_add_explicit(&stats->contended, 1, memory_order_relaxed);
+        }
+    }
+    else if (ret == 0){
+        record_acquire(stats, site, false, 0, now_ns());
+    }
+    return ret;
+}
+
+int lockprof_unlock(pthread_mutex_t* mutex)
+{
+    struct lock_stats* stats = lock_stats_get(mutex, NULL);
+    uint64_t hold;
+
+    if (stats != NULL){
+        hold = now_ns() - stats->held_since;
+        atomic_fetch_add_explicit(&stats->hold_ns, hold, memory_order_relaxed);
+        max_update(&stats->hold_max_ns, hold);
+        hist_add(stats->hold_hist, hold);
+    }
+    return pthread_mutex_unlock(mutex);
+}
+
+static double ns_to_ms(uint64_t ns)
+{
+    return ns / 1e6;
+}
+
+/**
+ * Format the upper bound of histogram @param bucket into @param buf
+ */
+static void bucket_bound(char* buf, size_t size, int bucket)
+{
+    uint64_t ns = 1ULL << bucket;
+
+    if (bucket == 0){
+        snprintf(buf, size, "0");
+    }
+    else if (bucket == LOCKPROF_BUCKETS - 1){
+        snprintf(buf, size, "longer");
+    }
+    else if (ns < 1000){
+        snprintf(buf, size, "<%lluns", (unsigned long long) ns);
+    }
+    else if (ns < 1000000){
+        snprintf(buf, size, "<%lluus", (unsigned long long) ns / 1000);
+    }
+    else if (ns < 1000000000){
+        snprintf(buf, size, "<%llums", (unsigned long long) ns / 1000000);
+    }
+    else {
+        snprintf(buf, size, "<%llus", (unsigned long long) ns / 1000000000);
+    }
+}
+
+static void dump_hist(const char* name, const char* what, atomic_ulong* hist)
+{
+    char line[1024];
+    char bound[32];
+    size_t len = 0;
+
+    for (int b = 0; b < LOCKPROF_BUCKETS && len < sizeof(line); b++){
+        unsigned long count = atomic_load_explicit(&hist[b], memory_order_relaxed);
+        if (count == 0){
+            continue;
+        }
+        bucket_bound(bound, sizeof(bound), b);
+        len += snprintf(line + len, sizeof(line) - len, " %s:%lu", bound, count);
+    }
+    if (len > 0){
+        syslog(LOG_DEBUG, "lockprof: %s %s%s", name, what, line);
+    }
+}
+
+static int site_cmp(const void* a, const void* b)
+{
+    unsigned long long wa = atomic_load(&(*(struct lockprof_site* const*) a)->wait_ns);
+    unsigned long long wb = atomic_load(&(*(struct lockprof_site* const*) b)->wait_ns);
+    unsigned long ca = atomic_load(&(*(struct lockprof_site* const*) a)->contended);
+    unsigned long cb = atomic_load(&(*(struct lockprof_site* const*) b)->contended);
+
+    if (wa != wb){
+        return wa < wb ? 1 : -1;
+    }
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+void lockprof_dump(void)
+{
+    struct lockprof_site* top[LOCKPROF_MAX_SITES];
+    size_t ntop = 0;
+
+    for (size_t i = 0; i < LOCKPROF_MAX_LOCKS; i++){
+        struct lock_stats* stats = &locks[i];
+        const char* name = atomic_load(&stats->name);
+        unsigned long acquired = atomic_load(&stats->acquired);
+        if (name == NULL || acquired == 0){
+            continue;
+        }
+        syslog(LOG_DEBUG, "lockprof: %s acquired %lu, contended %lu, "
+                "wait %.3f ms (max %.3f), hold %.3f ms (max %.3f)",
+                name, acquired, atomic_load(&stats->contended),
+                ns_to_ms(atomic_load(&stats->wait_ns)), ns_to_ms(atomic_load(&stats->wait_max_ns)),
+                ns_to_ms(atomic_load(&stats->hold_ns)), ns_to_ms(atomic_load(&stats->hold_max_ns)));
+        dump_hist(name, "wait", stats->wait_hist);
+        dump_hist(name, "hold", stats->hold_hist);
+    }
+
+    for (struct lockprof_site* site = atomic_load(&sites); site != NULL && ntop < LOCKPROF_MAX_SITES;
+            site = site->next){
+        if (atomic_load(&site->contended) > 0){
+            top[ntop++] = site;
+        }
+    }
+    qsort(top, ntop, sizeof(top[0]), site_cmp);
+    for (size_t i = 0; i < ntop && i < LOCKPROF_TOP_SITES; i++){
+        syslog(LOG_DEBUG, "lockprof: contended at %s:%d (%s) %lu of %lu times, wait %.3f ms",
+                top[i]->file, top[i]->line, lock_label(top[i]->lock_name),
+                atomic_load(&top[i]->contended), atomic_load(&top[i]->acquired),
+                ns_to_ms(atomic_load(&top[i]->wait_ns)));
+    }
+}
@@ -0,0 +1,63 @@
+/*
+ * lockprof.h
+ *
+ *  @brief Optional pthread mutex contention profiler
+ *
+ * Build with -DLOCKPROF=1 and lockprof.c (make LOCKPROF=1 for aesdsocket) to record,
+ * for each mutex taken through the macros below, the acquire count, wait and hold time
+ * histograms and the call sites waiting the longest. Without it the macros are plain
+ * pthread calls.
+ */
+
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <pthread.h>
+
+#ifndef LOCKPROF
+#define LOCKPROF 0
+#endif
+
+#if LOCKPROF
+
+#include <stdatomic.h>
+
+/**
+ * One place in the source taking a lock, statically allocated by the macros
+ */
+struct lockprof_site {
+    const char* file;
+    int line;
+    const char* lock_name;
+    atomic_bool registered;
+    struct lockprof_site* next;
+    atomic_ulong acquired;
+    atomic_ulong contended;
+    atomic_ullong wait_ns;
+};
+
+int lockprof_lock(pthread_mutex_t* mutex, struct lockprof_site* site);
+int lockprof_trylock(pthread_mutex_t* mutex, struct lockprof_site* site);
+int lockprof_unlock(pthread_mutex_t* mutex);
+
+/**
+ * Write the statistics of every lock to syslog. Also done at exit.
+ */
+void lockprof_dump(void);
+
+#define LOCKPROF_SITE(mutex) \
+    ({ static struct lockprof_site lockprof_site_ = { .file = __FILE__, .line = __LINE__, .lock_name = #mutex }; &lockprof_site_; })
+#define lockprof_mutex_lock(mutex) lockprof_lock((mutex), LOCKPROF_SITE(mutex))
+#define lockprof_mutex_trylock(mutex) lockprof_trylock((mutex), LOCKPROF_SITE(mutex))
+#define lockprof_mutex_unlock(mutex) lockprof_unlock(mutex)
+
+#else
+
+#define lockprof_mutex_lock(mutex) pthread_mutex_lock(mutex)
+#define lockprof_mutex_trylock(mutex) pthread_mutex_trylock(mutex)
+#define lockprof_mutex_unlock(mutex) pthread_mutex_unlock(mutex)
+#define lockprof_dump() do {} while (0)
+
+#endif
+
+#endif /* LOCKPROF_H */
@@ -0,0 +1,202 @@
+#include "unity.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+* Offset and sequence number lookups of the circular buffer, which back the
+* AESDCHAR_IOCSEEKTO and AESDCHAR_IOCSEEKSEQ ioctls of the driver, and eviction
+* by the max_entries and max_bytes budgets.
+* Record i of a test holds i + 1 bytes unless set otherwise, so offsets can be checked by hand.
+*/
+
+#define TEST_RECORDS (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 3)
+
+static const char record_data[] = "abcdefghijklmnopqrstuvwxyz";
+static struct aesd_buffer_entry records[TEST_RECORDS];
+
+static void add_records(struct aesd_circular_buffer *buffer, size_t first, size_t count)
+{
+    for (size_t i = first; i < first + count; i++) {
+        records[i].buffptr = record_data;
+        records[i].size = i + 1;
+        records[i].zsize = 0;
+        aesd_circular_buffer_add_entry(buffer, &records[i]);
+    }
+}
+
+void test_circular_buffer_seekto_after_wraparound()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entry;
+    size_t entry_offset;
+
+    aesd_circular_buffer_init(&buffer);
+    add_records(&buffer, 0, TEST_RECORDS);
+    // records 0 to 2 were overwritten, record 3 (4 bytes) is the oldest
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, aesd_circular_buffer_offset_adjust(&buffer, 0, 0),
+            "SEEKTO counts from the oldest record, not from slot 0");
+    TEST_ASSERT_EQUAL_INT(4, aesd_circular_buffer_offset_adjust(&buffer, 1, 0));
+    TEST_ASSERT_EQUAL_INT(4 + 5 + 1, aesd_circular_buffer_offset_adjust(&buffer, 2, 1));
+    // the newest record, past the end of the entry array
+    TEST_ASSERT_EQUAL_INT((4 + 12) * 9 / 2 + 12, aesd_circular_buffer_offset_adjust(&buffer, 9, 12));
+
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 4 + 5 + 1, &entry_offset);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(&records[5], entry, "a SEEKTO offset must land in the record it names");
+    TEST_ASSERT_EQUAL_INT(1, entry_offset);
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, aesd_circular_buffer_offset_adjust(&buffer, 10, 0),
+            "only 10 records are held");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, aesd_circular_buffer_offset_adjust(&buffer, 2, 6),
+            "record 5 holds 6 bytes");
+}
+
+void test_circular_buffer_seq_evicted()
+{
+    struct aesd_circular_buffer buffer;
+
+    aesd_circular_buffer_init(&buffer);
+    add_records(&buffer, 0, TEST_RECORDS);
+    TEST_ASSERT_EQUAL_UINT64(3, aesd_circular_buffer_oldest_seq(&buffer));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ERANGE, aesd_circular_buffer_seq_offset(&buffer, 0),
+            "an overwritten seq is out of range");
+    TEST_ASSERT_EQUAL_INT(-ERANGE, aesd_circular_buffer_seq_offset(&buffer, 2));
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_seq_offset(&buffer, 3));
+    TEST_ASSERT_EQUAL_INT(4 + 5, aesd_circular_buffer_seq_offset(&buffer, 5));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-EINVAL, aesd_circular_buffer_seq_offset(&buffer, TEST_RECORDS + 1),
+            "a seq never added is invalid");
+}
+
+void test_circular_buffer_seq_gap()
+{
+    struct aesd_circular_buffer buffer;
+
+    aesd_circular_buffer_init(&buffer);
+    add_records(&buffer, 0, 2);
+    // as when restoring persisted records, seqs 2 to 4 were dropped
+    buffer.entries_added = 5;
+    add_records(&buffer, 2, 2);
+    TEST_ASSERT_EQUAL_UINT64(5, records[2].seq);
+    TEST_ASSERT_EQUAL_INT(1, aesd_circular_buffer_seq_offset(&buffer, 1));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-ERANGE, aesd_circular_buffer_seq_offset(&buffer, 2),
+            "a dropped seq is out of range, not the offset of the next record");
+    TEST_ASSERT_EQUAL_INT(-ERANGE, aesd_circular_buffer_seq_offset(&buffer, 4));
+    TEST_ASSERT_EQUAL_INT(1 + 2, aesd_circular_buffer_seq_offset(&buffer, 5));
+    TEST_ASSERT_EQUAL_INT(1 + 2 + 3, aesd_circular_buffer_seq_offset(&buffer, 6));
+}
+
+void test_circular_buffer_seq_next_is_end()
+{
+    struct aesd_circular_buffer buffer;
+
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(0, aesd_circular_buffer_oldest_seq(&buffer),
+            "an empty buffer starts at the next seq");
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_seq_offset(&buffer, 0));
+
+    add_records(&buffer, 0, TEST_RECORDS);
+    TEST_ASSERT_EQUAL_UINT64(TEST_RECORDS, buffer.entries_added);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(buffer.size, aesd_circular_buffer_seq_offset(&buffer, TEST_RECORDS),
+            "the next seq seeks to the end of the held records");
+    TEST_ASSERT_EQUAL_INT((4 + 13) * 10 / 2, buffer.size);
+}
+
+static size_t add_record_evict(struct aesd_circular_buffer *buffer, size_t i, size_t size,
+        struct aesd_buffer_entry **evicted)
+{
+    records[i].buffptr = record_data;
+    records[i].size = size;
+    records[i].zsize = 0;
+    return aesd_circular_buffer_add_entry_evict(buffer, &records[i], evicted);
+}
+
+void test_circular_buffer_evict_max_entries()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *evicted[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+
+    aesd_circular_buffer_init(&buffer);
+    buffer.max_entries = 3;
+    for (size_t i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL_UINT(0, add_record_evict(&buffer, i, 1, evicted));
+    }
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(1, add_record_evict(&buffer, 3, 1, evicted),
+            "the fourth record evicts the oldest one");
+    TEST_ASSERT_EQUAL_PTR(&records[0], evicted[0]);
+    TEST_ASSERT_EQUAL_UINT(1, add_record_evict(&buffer, 4, 1, evicted));
+    TEST_ASSERT_EQUAL_PTR(&records[1], evicted[0]);
+    TEST_ASSERT_EQUAL_UINT(3, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL_UINT64(2, aesd_circular_buffer_oldest_seq(&buffer));
+}
+
+void test_circular_buffer_evict_max_bytes()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *evicted[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+
+    aesd_circular_buffer_init(&buffer);
+    buffer.max_bytes = 10;
+    for (size_t i = 0; i < 4; i++) {
+        TEST_ASSERT_EQUAL_UINT(0, add_record_evict(&buffer, i, i + 1, evicted));
+    }
+    TEST_ASSERT_EQUAL_UINT(10, buffer.stored_bytes);
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(3, add_record_evict(&buffer, 4, 5, evicted),
+            "records are evicted oldest first until the new one fits");
+    TEST_ASSERT_EQUAL_PTR(&records[0], evicted[0]);
+    TEST_ASSERT_EQUAL_PTR(&records[1], evicted[1]);
+    TEST_ASSERT_EQUAL_PTR(&records[2], evicted[2]);
+    TEST_ASSERT_EQUAL_UINT(4 + 5, buffer.stored_bytes);
+    TEST_ASSERT_EQUAL_INT(4 + 5, buffer.size);
+
+    // a compressed record counts by the memory it holds
+    records[5].buffptr = record_data;
+    records[5].size = 100;
+    records[5].zsize = 1;
+    TEST_ASSERT_EQUAL_UINT(0, aesd_circular_buffer_add_entry_evict(&buffer, &records[5], evicted));
+    TEST_ASSERT_EQUAL_UINT(4 + 5 + 1, buffer.stored_bytes);
+    TEST_ASSERT_EQUAL_INT(4 + 5 + 100, buffer.size);
+}
+
+void test_circular_buffer_evict_oversized()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *evicted[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+
+    aesd_circular_buffer_init(&buffer);
+    buffer.max_bytes = 10;
+    for (size_t i = 0; i < 3; i++) {
+        add_record_evict(&buffer, i, i + 1, evicted);
+    }
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(3, add_record_evict(&buffer, 3, 20, evicted),
+            "a record larger than max_bytes evicts everything");
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(1, aesd_circular_buffer_count(&buffer), "and is still stored");
+    TEST_ASSERT_EQUAL_UINT(20, buffer.stored_bytes);
+    TEST_ASSERT_EQUAL_UINT64(3, aesd_circular_buffer_oldest_seq(&buffer));
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_seq_offset(&buffer, 3));
+}
+
+void test_circular_buffer_evict_fpos_ends_at_cleared_slot()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *evicted[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry *entry;
+    size_t entry_offset;
+
+    aesd_circular_buffer_init(&buffer);
+    buffer.max_bytes = 12;
+    for (size_t i = 0; i < 8; i++) {
+        add_record_evict(&buffer, i, 1, evicted);
+    }
+    // slots 0 to 5 are emptied, then 6 and 7, and the ring wraps back to slot 0
+    TEST_ASSERT_EQUAL_UINT(6, add_record_evict(&buffer, 8, 10, evicted));
+    TEST_ASSERT_EQUAL_UINT(2, add_record_evict(&buffer, 9, 2, evicted));
+    TEST_ASSERT_EQUAL_UINT(2, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_NULL_MESSAGE(buffer.entry[0], "evicted slots are cleared");
+
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 11, &entry_offset);
+    TEST_ASSERT_EQUAL_PTR(&records[9], entry);
+    TEST_ASSERT_EQUAL_INT(1, entry_offset);
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 12, &entry_offset),
+            "the search ends at the first cleared slot instead of reaching evicted records");
+}